@@ -45,21 +45,28 @@ CRC_HandleTypeDef hcrc;
 
 UART_HandleTypeDef huart1;
 UART_HandleTypeDef huart2;
+DMA_HandleTypeDef hdma_usart1_rx;
+DMA_HandleTypeDef hdma_usart2_rx;
+DMA_HandleTypeDef hdma_usart1_tx;
+DMA_HandleTypeDef hdma_usart2_tx;
 
 /* USER CODE BEGIN PV */
-extern volatile uint8_t s_rx_byte;
-extern volatile uint8_t s_packet_ready;
-
+#if (R_UART_LISTEN_BOTH != 0)
+UART_HandleTypeDef *p_uart = NULL;		// Bound to the UART that starts the session (see r_uart_bind)
+#else
 UART_HandleTypeDef *p_uart = &huart2;
+#endif
 
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_CRC_Init(void);
 static void MX_USART1_UART_Init(void);
 static void MX_USART2_UART_Init(void);
+static void MX_NVIC_Init(void);
 /* USER CODE BEGIN PFP */
 
 /* USER CODE END PFP */
@@ -98,13 +105,21 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_CRC_Init();
   MX_USART1_UART_Init();
   MX_USART2_UART_Init();
+
+  /* Initialize interrupts */
+  MX_NVIC_Init();
   /* USER CODE BEGIN 2 */
 	
-	//HAL_UART_Receive_IT(&huart1, &s_rx_byte, 1);
-	HAL_UART_Receive_IT(p_uart, (uint8_t *)&s_rx_byte, 1);
+	// Bytes are queued by the DMA/IRQ and framed in the main loop (see r_uart_process_rx)
+#if (R_UART_LISTEN_BOTH != 0)
+	r_uart_start_listening(&huart1, &huart2);
+#else
+	r_uart_start_reception(p_uart);
+#endif
 	
 
 	
@@ -121,8 +136,9 @@ int main(void)
 	
 	if (ee_eeprom.flag_update == FLAG_VALUE_TRUE)
 	{
-		uint8_t msg[] = "ACK\n";
-		HAL_UART_Transmit(p_uart, msg, sizeof(msg), HAL_MAX_DELAY);
+		// The update starts here when the App took the start command: switch before the host hears from us
+		r_clock_update_profile();
+		r_send_ack();
 	}
 	
   /* USER CODE END 2 */
@@ -131,6 +147,14 @@ int main(void)
   /* USER CODE BEGIN WHILE */
   while (1)
   {	
+		r_uart_process_rx();
+		
+		// Pages are programmed while the next packets keep arriving
+		r_flash_pipeline_process();
+		
+		// An unconfirmed baud rate switch falls back to the previous rate
+		r_baud_process();
+		
 		if(s_packet_ready != 0){
 			
 		
@@ -203,6 +227,17 @@ void SystemClock_Config(void)
   }
 }
 
+/**
+  * @brief NVIC Configuration.
+  * @retval None
+  */
+static void MX_NVIC_Init(void)
+{
+  /* FLASH_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(FLASH_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(FLASH_IRQn);
+}
+
 /**
   * @brief CRC Initialization Function
   * @param None
@@ -277,6 +312,27 @@ static void MX_USART1_UART_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN USART1_Init 2 */
+#if (R_UART_FLOW_CONTROL != UART_HWCONTROL_NONE)
+  /* Flow control from r_ota_config.h. An overrun only costs the packet (its CRC), not the ring */
+  huart1.Init.HwFlowCtl = R_UART_FLOW_CONTROL;
+  huart1.AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_RXOVERRUNDISABLE_INIT;
+  huart1.AdvancedInit.OverrunDisable = UART_ADVFEATURE_OVERRUN_DISABLE;
+  if (HAL_UART_Init(&huart1) != HAL_OK)
+  {
+    Error_Handler();
+  }
+#endif
+#if (R_UART_RX_MODE == R_UART_RX_MODE_FIFO)
+  /* RX FIFO from r_ota_config.h: each threshold interrupt reads several bytes */
+  if (HAL_UARTEx_SetRxFifoThreshold(&huart1, R_UART_RX_FIFO_THRESHOLD) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  if (HAL_UARTEx_EnableFifoMode(&huart1) != HAL_OK)
+  {
+    Error_Handler();
+  }
+#endif
 
   /* USER CODE END USART1_Init 2 */
 
@@ -325,11 +381,58 @@ static void MX_USART2_UART_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN USART2_Init 2 */
+#if (R_UART_FLOW_CONTROL != UART_HWCONTROL_NONE)
+  /* Flow control from r_ota_config.h. An overrun only costs the packet (its CRC), not the ring */
+  huart2.Init.HwFlowCtl = R_UART_FLOW_CONTROL;
+  huart2.AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_RXOVERRUNDISABLE_INIT;
+  huart2.AdvancedInit.OverrunDisable = UART_ADVFEATURE_OVERRUN_DISABLE;
+  if (HAL_UART_Init(&huart2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+#endif
+#if (R_UART_RX_MODE == R_UART_RX_MODE_FIFO)
+  /* RX FIFO from r_ota_config.h: each threshold interrupt reads several bytes */
+  if (HAL_UARTEx_SetRxFifoThreshold(&huart2, R_UART_RX_FIFO_THRESHOLD) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  if (HAL_UARTEx_EnableFifoMode(&huart2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+#endif
 
   /* USER CODE END USART2_Init 2 */
 
 }
 
+/**
+  * Enable DMA controller clock
+  */
+static void MX_DMA_Init(void)
+{
+
+  /* DMA controller clock enable */
+  __HAL_RCC_DMAMUX1_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  /* DMA interrupt init */
+  /* DMA1_Channel1_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+  /* DMA1_Channel2_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel2_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel2_IRQn);
+  /* DMA1_Channel4_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+  /* DMA1_Channel5_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+
+}
+
 /**
   * @brief GPIO Initialization Function
   * @param None
@@ -15,13 +15,53 @@
 #include "stdint.h"
 
 #include "r_flash_addresses.h"
+#include "r_ota_config.h"
+
+/**
+ * @brief Running CRC-32 over a byte stream.
+ *
+ * Fed piece by piece with r_crc_update(), it gives the same value as
+ * r_calculate_flash_crc() over the concatenated bytes.
+ */
+typedef struct
+{
+    uint32_t crc;       /**< Current CRC register. */
+    uint32_t length;    /**< Bytes fed so far. */
+} R_CRC_CTX_;
+
+/**
+ * @brief Start a running CRC.
+ *
+ * @param ctx   Context to initialize.
+ */
+void r_crc_init(R_CRC_CTX_ *ctx);
+
+/**
+ * @brief Feed bytes to a running CRC.
+ *
+ * Any length is accepted, the bytes are processed in stream order.
+ *
+ * @param ctx      Running CRC.
+ * @param data     Bytes to add (RAM or flash address).
+ * @param length   Number of bytes.
+ */
+void r_crc_update(R_CRC_CTX_ *ctx, const uint8_t *data, size_t length);
+
+/**
+ * @brief Get the CRC of every byte fed so far.
+ *
+ * The context is left untouched and can keep being updated.
+ *
+ * @param ctx   Running CRC.
+ * @return Computed CRC32 value.
+ */
+uint32_t r_crc_final(const R_CRC_CTX_ *ctx);
 
 /**
  * @brief Calculate CRC over firmware data stored in flash memory.
  *
- * This function computes a CRC32 value for a firmware image stored in flash.
- * The algorithm processes the data word by word (4 bytes), and handles any
- * remaining bytes at the end.
+ * This function computes a CRC32 value for a firmware image stored in flash
+ * in a single pass over the whole image.
  *
  * @param ota_fw_received_size   Size of the firmware image in bytes.
  * @param address                Starting address of the firmware in flash.
@@ -41,18 +81,20 @@ uint32_t r_calculate_flash_crc(uint32_t ota_fw_received_size, uint32_t address);
 uint32_t r_calculate_word_crc(uint8_t *data);
 
 /**
- * @brief Calculate CRC over ETX_OTA_DATA_MAX_SIZE bytes of data.
+ * @brief Calculate the CRC of the data carried by a data packet.
  *
- * @param data   Pointer to the input data.
+ * @param data   Pointer to the packet data.
+ * @param length Data bytes in the packet (data_len).
  * @return Computed CRC32 value.
  */
-uint32_t r_calculate_word_crc_datapack(uint8_t *data);
+uint32_t r_calculate_word_crc_datapack(uint8_t *data, size_t length);
 
 /**
  * @brief Calculate CRC over a page of data.
  *
  * This function computes a CRC32 value over a memory page. The page length
- * may not necessarily be a multiple of 4, so any remaining bytes are ignored.
+ * may not be a multiple of 4 (last page of the image), the trailing bytes
+ * are included like in r_calculate_flash_crc().
  *
  * @param data_page   Pointer to the page data.
  * @param length      Size of the page in bytes.
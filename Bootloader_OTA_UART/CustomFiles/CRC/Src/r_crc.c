@@ -6,14 +6,58 @@
  * @date 22/08/2025
  *
  * @details
- * This module provides a precomputed CRC-32 table and function prototypes
- * for calculating CRC checksums over firmware data stored in flash memory.
+ * This module provides a running CRC-32 and function prototypes for
+ * calculating CRC checksums over firmware data stored in flash memory.
  * These functions are used in the bootloader to validate firmware integrity
  * during OTA updates and flash operations.
+ *
+ * Every calculation goes through r_crc_update(), computed by the backend
+ * selected with R_CRC_BACKEND: the precomputed table in software, or the
+ * CRC peripheral fed by the CPU or by the DMA. All of them give the same
+ * values.
  */
 
 #include "r_crc.h"
 
+#if (R_CRC_BACKEND != R_CRC_BACKEND_SW)
+/**
+ * @brief CRC peripheral handle initialized by MX_CRC_Init().
+ *
+ * Default polynomial and init value, no reflection and bytes input, the
+ * same CRC-32 as @ref s_crc_table.
+ */
+extern CRC_HandleTypeDef hcrc;
+#endif
+
+#if (R_CRC_BACKEND == R_CRC_BACKEND_HW_DMA)
+/**
+ * @brief Largest DMA transfer in bytes (the channel counter is 16 bits).
+ */
+#define R_CRC_DMA_CHUNK						0x8000U
+
+/**
+ * @brief Memory-to-memory DMA channel that feeds the CRC data register.
+ */
+static DMA_HandleTypeDef s_hdma_crc;
+
+/**
+ * @brief Set once @ref s_hdma_crc has been initialized.
+ */
+static uint8_t s_hdma_crc_ready = 0;
+
+/**
+ * @brief Feed bytes to the CRC data register through the DMA.
+ *
+ * One byte write per beat, so any length and alignment is accepted.
+ * Blocks until the last byte has been written.
+ *
+ * @param data     Bytes to add (RAM or flash address).
+ * @param length   Number of bytes.
+ */
+static void r_crc_dma_feed(const uint8_t *data, size_t length);
+#endif
+
+#if (R_CRC_BACKEND == R_CRC_BACKEND_SW)
 /**
  * @brief Precomputed CRC-32 table used for checksum calculations.
  *
@@ -65,149 +109,137 @@ static uint32_t s_crc_table[0x100] = { // Table for checksum
 		0x933eb0bb, 0x97ffad0c, 0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
 		0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
 };
+#endif
 
 
 
-/** Calculate CRC over firmware data in flash memory. */
-uint32_t 
-r_calculate_flash_crc(uint32_t ota_fw_received_size, uint32_t address)
+/** Start a running CRC. */
+void 
+r_crc_init(R_CRC_CTX_ *ctx)
 {
-    uint32_t crc = 0xFFFFFFFF;
-    const uint8_t *p_address = (const uint8_t *)address;
+    ctx->crc = 0xFFFFFFFF;
+    ctx->length = 0;
+}
 
-		// Number of full 32-bit words
-    uint32_t num_words = ota_fw_received_size / 4; 
-	
-		// Remaining bytes (03)
-    uint32_t remainder = ota_fw_received_size % 4;
+/** Feed bytes to a running CRC. */
+void 
+r_crc_update(R_CRC_CTX_ *ctx, const uint8_t *data, size_t length)
+{
+#if (R_CRC_BACKEND == R_CRC_BACKEND_SW)
+    uint32_t crc = ctx->crc;
 
-		// Process all complete 32-bit words
-    for (uint32_t i = 0; i < num_words; i++) 
+		// Bytes in stream order, most significant bit first
+    for (size_t i = 0; i < length; i++) 
 		{
-				// Construct a 32-bit word from 4 bytes (big-endian order)
-        uint32_t val = ((uint32_t)p_address[i*4]     << 24) |
-                       ((uint32_t)p_address[i*4 + 1] << 16) |
-                       ((uint32_t)p_address[i*4 + 2] <<  8) |
-                       ((uint32_t)p_address[i*4 + 3]);
-			
-				// Process each byte of the word
-        for (int j = 0; j < 4; j++) 
-				{
-            uint8_t byte = (val >> 24) & 0xFF;         		// Extract most significant byte
-            uint32_t idx = ((crc >> 24) ^ byte) & 0xFF;   // Lookup index for CRC table
-            crc = (crc << 8) ^ s_crc_table[idx];          // Update CRC using lookup table
-            val <<= 8;                           	        // Shift to next byte
-        }
+        crc = (crc << 8) ^ s_crc_table[((crc >> 24) ^ data[i]) & 0xFF];
     }
 
-		// Handle any remaining bytes (if firmware size not multiple of 4)
-    if (remainder) 
-		{
-        uint32_t val = 0;
-			
-				// Pack the remaining bytes into a 32-bit word (aligned left)
-        for (uint32_t j = 0; j < remainder; j++) 
-				{
-            val |= p_address[num_words*4 + j] << (24 - j*8);
-        }
-				
-				// Process each valid byte from the remainder
-        for (uint32_t j = 0; j < remainder; j++) 
-				{
-            uint8_t byte = (val >> 24) & 0xFF;
-            uint32_t idx = ((crc >> 24) ^ byte) & 0xFF;
-            crc = (crc << 8) ^ s_crc_table[idx];
-            val <<= 8;
-        }
-    }
+    ctx->crc = crc;
+#else
+		// Resume from the context: the reset loads INIT into the data register
+		__HAL_CRC_INITIALCRCVALUE_CONFIG(&hcrc, ctx->crc);
+		__HAL_CRC_DR_RESET(&hcrc);
+
+#if (R_CRC_BACKEND == R_CRC_BACKEND_HW_DMA)
+		r_crc_dma_feed(data, length);
+		ctx->crc = hcrc.Instance->DR;
+#else
+		// Bytes input: the HAL writes whole big-endian words, then the trailing bytes
+		ctx->crc = HAL_CRC_Accumulate(&hcrc, (uint32_t *)data, length);
+#endif
+#endif
+
+    ctx->length += length;
+}
 
-    return crc;
+/** Get the CRC of every byte fed so far. */
+uint32_t 
+r_crc_final(const R_CRC_CTX_ *ctx)
+{
+    return ctx->crc;
+}
+
+/** Calculate CRC over firmware data in flash memory. */
+uint32_t 
+r_calculate_flash_crc(uint32_t ota_fw_received_size, uint32_t address)
+{
+    R_CRC_CTX_ ctx;
+
+    r_crc_init(&ctx);
+    r_crc_update(&ctx, (const uint8_t *)address, ota_fw_received_size);
+
+    return r_crc_final(&ctx);
 }
 
 /**  Calculate CRC over a 32-bit data word. */
 uint32_t 
 r_calculate_word_crc(uint8_t *data)
 {   
-    uint32_t wordcrc = 0xFFFFFFFF;
+    R_CRC_CTX_ ctx;
 
-		// Process 16 bytes in blocks of 4 (total = 4 words)
-    for (int i = 0; i < 16; i += 4) 
-		{
-				// Construct a 32-bit word from 4 bytes
-        uint32_t word = ((uint32_t)data[i] << 24) |
-                        ((uint32_t)data[i+1] << 16) |
-                        ((uint32_t)data[i+2] << 8) |
-                        ((uint32_t)data[i+3]);
-
-        uint32_t val = word;
-
-				// Process each byte of the word
-        for (int j = 0; j < 4; j++) 
-				{
-            uint8_t byte = (val >> 24) & 0xFF;
-            uint8_t table_index = ((wordcrc >> 24) ^ byte) & 0xFF;
-            wordcrc = (wordcrc << 8) ^ s_crc_table[table_index];
-            val <<= 8;
-        }
-    }
+		// 16 bytes (4 words)
+    r_crc_init(&ctx);
+    r_crc_update(&ctx, data, 16);
 
-    return wordcrc & 0xFFFFFFFF;
+    return r_crc_final(&ctx);
 }
 
 uint32_t 
-r_calculate_word_crc_datapack(uint8_t *data)
+r_calculate_word_crc_datapack(uint8_t *data, size_t length)
 {   
-    uint32_t wordcrc = 0xFFFFFFFF;
+    R_CRC_CTX_ ctx;
 
-		// Process 16 bytes in blocks of 4 (total = 4 words)
-    for (int i = 0; i < 16; i += 4) 
-		{
-				// Construct a 32-bit word from 4 bytes
-        uint32_t word = ((uint32_t)data[i] << 24) |
-                        ((uint32_t)data[i+1] << 16) |
-                        ((uint32_t)data[i+2] << 8) |
-                        ((uint32_t)data[i+3]);
-
-        uint32_t val = word;
-
-				// Process each byte of the word
-        for (int j = 0; j < 4; j++) 
-				{
-            uint8_t byte = (val >> 24) & 0xFF;
-            uint8_t table_index = ((wordcrc >> 24) ^ byte) & 0xFF;
-            wordcrc = (wordcrc << 8) ^ s_crc_table[table_index];
-            val <<= 8;
-        }
-    }
+		// Only the data_len bytes the packet carries
+    r_crc_init(&ctx);
+    r_crc_update(&ctx, data, length);
 
-    return wordcrc & 0xFFFFFFFF;
+    return r_crc_final(&ctx);
 }
 
 /**  Calculate CRC over a Page. */
 uint32_t 
 r_calculate_page_crc(uint8_t *data_page, size_t length)
 {
-    uint32_t crc = 0xFFFFFFFF;
+    R_CRC_CTX_ ctx;
 
-    size_t num_words = length / 4;	// Number of complete 32-bit words
-
-    // Process all complete 32-bit words
-    for (size_t i = 0; i < num_words; i++) 
-		{
-        uint32_t val = ((uint32_t)data_page[i*4] << 24) |
-                       ((uint32_t)data_page[i*4 + 1] << 16) |
-                       ((uint32_t)data_page[i*4 + 2] << 8) |
-                       ((uint32_t)data_page[i*4 + 3]);
-				
-				// Process each byte of the word
-        for (int j = 0; j < 4; j++) 
-				{
-            uint8_t byte = (val >> 24) & 0xFF;
-            crc = (crc << 8) ^ s_crc_table[((crc >> 24) ^ byte) & 0xFF];
-            val <<= 8;
-        }
-    }
+    r_crc_init(&ctx);
+    r_crc_update(&ctx, data_page, length);
 		
-		return crc & 0xFFFFFFFF;
+		return r_crc_final(&ctx);
 }
 
+#if (R_CRC_BACKEND == R_CRC_BACKEND_HW_DMA)
+static void 
+r_crc_dma_feed(const uint8_t *data, size_t length)
+{
+		if(!s_hdma_crc_ready)
+		{
+			// Memory to memory: the source is the "peripheral" side of the channel
+			s_hdma_crc.Instance = R_CRC_DMA_CHANNEL;
+			s_hdma_crc.Init.Request = DMA_REQUEST_MEM2MEM;
+			s_hdma_crc.Init.Direction = DMA_MEMORY_TO_MEMORY;
+			s_hdma_crc.Init.PeriphInc = DMA_PINC_ENABLE;
+			s_hdma_crc.Init.MemInc = DMA_MINC_DISABLE;
+			s_hdma_crc.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+			s_hdma_crc.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+			s_hdma_crc.Init.Mode = DMA_NORMAL;
+			s_hdma_crc.Init.Priority = DMA_PRIORITY_LOW;
+			if(HAL_DMA_Init(&s_hdma_crc) != HAL_OK)
+			{
+				Error_Handler();
+			}
+			s_hdma_crc_ready = 1;
+		}
+
+		while(length > 0)
+		{
+			uint32_t chunk = (length > R_CRC_DMA_CHUNK) ? R_CRC_DMA_CHUNK : length;
+
+			HAL_DMA_Start(&s_hdma_crc, (uint32_t)data, (uint32_t)&hcrc.Instance->DR, chunk);
+			HAL_DMA_PollForTransfer(&s_hdma_crc, HAL_DMA_FULL_TRANSFER, HAL_MAX_DELAY);
+
+			data += chunk;
+			length -= chunk;
+		}
+}
+#endif
@@ -1,11 +1,156 @@
+/**
+ * @file r_uart_callback.h
+ * @brief UART reception and transmission callbacks and OTA packet framer.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 22/08/2025
+ *
+ */
+
 #ifndef R_UART_CALLBACK_H
 #define R_UART_CALLBACK_H
 
 #include "stdint.h"
 #include "stm32wlxx_hal.h"
+#include "r_ota_config.h"
 #include "r_startup.h"
 #include "r_routine_update.h"
 
+/**
+ * @brief Flag indicating that a complete OTA packet is waiting in g_rx_buffer.
+ */
+extern volatile uint8_t s_packet_ready;
+
+/**
+ * @brief Flag set with s_packet_ready when the framer dropped a bad frame instead of receiving a packet.
+ */
+extern volatile uint8_t s_frame_error;
+
+/**
+ * @brief Arm the UART reception in the mode selected by R_UART_RX_MODE.
+ *
+ * Receives on this UART alone, over the whole reception ring.
+ *
+ * @param huart UART used to receive the update.
+ */
+void r_uart_start_reception(UART_HandleTypeDef *huart);
+
+/**
+ * @brief Arm the reception on two UARTs at once, each over half of the ring.
+ *
+ * Only with R_UART_LISTEN_BOTH. Each UART has its own framer, the packets
+ * of both land in g_rx_buffer one at a time until r_uart_bind().
+ *
+ * @param huart_a First UART.
+ * @param huart_b Second UART.
+ */
+void r_uart_start_listening(UART_HandleTypeDef *huart_a, UART_HandleTypeDef *huart_b);
+
+/**
+ * @brief Keep receiving only on the UART the packet in g_rx_buffer came from.
+ *
+ * The other UART stops listening and this one is re-armed over the whole
+ * ring, so the bytes it had not framed yet are dropped: call it on a
+ * packet the host waits an answer for.
+ *
+ * @return The UART kept, or NULL if no packet has been received yet.
+ */
+UART_HandleTypeDef *r_uart_bind(void);
+
+/**
+ * @brief Stop the UART reception started by r_uart_start_reception() or r_uart_start_listening().
+ *
+ * Must be called before jumping to the application so no DMA transfer
+ * or UART interrupt is left running.
+ */
+void r_uart_stop_reception(void);
+
+/**
+ * @brief Drain the reception ring buffer through the packet framer.
+ *
+ * Runs in the main loop. Stops as soon as a complete packet has been
+ * copied into g_rx_buffer, and resumes once s_packet_ready is cleared.
+ * A frame left incomplete for R_UART_FRAME_TIMEOUT_MS is reported with
+ * s_frame_error instead.
+ */
+void r_uart_process_rx(void);
+
+/**
+ * @brief Deassert or assert RTS from the room left in the reception ring.
+ *
+ * Only with RTS in R_UART_FLOW_CONTROL. Called by r_uart_process_rx(),
+ * and by any loop that waits without it, such as the wait for a page
+ * buffer.
+ */
+void r_uart_flow_control(void);
+
+/**
+ * @brief Send bytes in the mode selected by R_UART_TX_MODE.
+ *
+ * In the queued modes the bytes are copied into the transmission queue
+ * and the call returns right away, unless the queue is full, then it
+ * waits for room. Bytes for another UART are only queued once the
+ * previous ones are sent.
+ *
+ * @param huart  UART to send through.
+ * @param data   Bytes to send.
+ * @param length Number of bytes.
+ */
+void r_uart_send(UART_HandleTypeDef *huart, const uint8_t *data, uint16_t length);
+
+/**
+ * @brief Send bytes through every UART receiving, with r_uart_send().
+ *
+ * For the answers sent before a UART is bound, when the host may be on
+ * any of them.
+ *
+ * @param data   Bytes to send.
+ * @param length Number of bytes.
+ */
+void r_uart_send_listening(const uint8_t *data, uint16_t length);
+
+/**
+ * @brief Wait until every byte queued by r_uart_send() has been sent.
+ *
+ * Must be called before jumping to the application or resetting, so the
+ * last response reaches the host and no transfer is left running.
+ */
+void r_uart_flush_tx(void);
+
+/**
+ * @brief Check that a baud rate can be reached from the UART clock.
+ *
+ * @param huart UART to configure.
+ * @param baud  Baud rate proposed.
+ * @return HAL_OK, or HAL_ERROR if it is above R_OTA_BAUD_MAX or off by more than R_OTA_BAUD_ERROR_PERMILLE.
+ */
+HAL_StatusTypeDef r_uart_baud_check(UART_HandleTypeDef *huart, uint32_t baud);
+
+/**
+ * @brief Switch the UART to another baud rate.
+ *
+ * Waits for the queued bytes to go out at the current rate, and restarts
+ * the reception from an empty ring if it was running.
+ *
+ * @param huart UART to configure.
+ * @param baud  New baud rate.
+ * @return HAL_OK, or HAL_ERROR (rate unchanged) if r_uart_baud_check() refuses it.
+ */
+HAL_StatusTypeDef r_uart_set_baud(UART_HandleTypeDef *huart, uint32_t baud);
+
+/**
+ * @brief Keep the baud rate of every UART receiving after a change of their clock.
+ *
+ * @return HAL_OK, or HAL_ERROR if a rate can no longer be reached from the new clock.
+ */
+HAL_StatusTypeDef r_uart_clock_changed(void);
+
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
 
-#endif //R_UART_CALLBACK_H
\ No newline at end of file
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size);
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+#endif //R_UART_CALLBACK_H
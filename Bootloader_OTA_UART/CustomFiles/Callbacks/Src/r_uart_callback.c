@@ -1,14 +1,50 @@
 #include "r_uart_callback.h"
 
+/* Private define ------------------------------------------------------------*/
+/** Smallest and largest BRR values allowed by the USART (not exported by the HAL) */
+#define R_UART_BRR_MIN		0x10U
+#define R_UART_BRR_MAX		0xFFFFU
+
+/** UARTs that can be receiving at the same time */
+#if (R_UART_LISTEN_BOTH != 0)
+#define R_UART_RX_PORTS		2U
+#else
+#define R_UART_RX_PORTS		1U
+#endif
+
+/** Bytes of a frame before its data: SOF, type and Len */
+#define R_UART_FRAME_HEADER		4U
+/** Bytes of a frame after its data: CRC and end of frame (0D0A) */
+#define R_UART_FRAME_TRAILER	6U
 
 /* Private typedef -----------------------------------------------------------*/
 /* USER CODE BEGIN PTD */
 /**
- * @brief Current write index for @ref uart_buffer.
+ * @brief Reception and framer state of one UART.
  *
- * Incremented with each received byte. Resets once a packet is processed.
+ * Each port has its own piece of the reception ring and its own packet
+ * being framed, so bytes from two UARTs never mix in a packet.
  */
-static volatile uint16_t s_uart_index = 0;
+typedef struct
+{
+    UART_HandleTypeDef *huart;      /**< UART received from, NULL when the port is not armed. */
+    uint8_t *ring;                  /**< Piece of s_rx_ring used by the port. */
+    uint16_t size;                  /**< Bytes in @ref ring. */
+    volatile uint16_t head;         /**< Next byte written by the reception (FIFO mode: start of the reception in progress). */
+    uint16_t tail;                  /**< Next byte read by the framer. */
+    volatile uint8_t restart;       /**< Set when the DMA reception restarted at the beginning of @ref ring. */
+    volatile uint8_t rx_byte;       /**< Last byte received, only with R_UART_RX_MODE_IT. */
+    uint8_t *buffer;                /**< Frame being received, starts with ETX_OTA_SOF when not empty. */
+    uint16_t index;                 /**< Bytes held in @ref buffer. */
+    uint16_t len_frame;             /**< Bytes of the whole frame, 0 until its header is checked. */
+    uint8_t dropped;                /**< Set when bytes were dropped and no packet was delivered after them. */
+    uint32_t tick;                  /**< HAL tick of the last byte taken from the ring, for R_UART_FRAME_TIMEOUT_MS. */
+#if ((R_UART_FLOW_CONTROL & UART_HWCONTROL_RTS) != 0)
+    uint8_t paused;                 /**< Set while the port stops reading the UART, so RTS is deasserted. */
+    uint32_t paused_cr1;            /**< CR1 receive interrupt enables cleared by the pause. */
+    uint32_t paused_cr3;            /**< CR3 receive interrupt enables cleared by the pause. */
+#endif
+} R_UART_RX_PORT_;
 
 /**
  * @brief Flag indicating that a complete OTA packet has been received.
@@ -18,72 +54,830 @@ static volatile uint16_t s_uart_index = 0;
 volatile uint8_t s_packet_ready = 0;
 
 /**
- * @brief UART reception buffer for OTA packets.
+ * @brief Set with s_packet_ready when the framer reports a bad frame instead of a packet.
  *
- * Stores incoming bytes until a complete OTA packet is received.
+ * g_rx_buffer is not written. Cleared by the update task.
  */
-static uint8_t s_uart_buffer[ETX_OTA_PACKET_MAX_SIZE] = {0};
+volatile uint8_t s_frame_error = 0;
 
 /**
- * @brief Temporary storage for the most recently received UART byte.
+ * @brief Packets being framed, one per port.
  */
-volatile uint8_t s_rx_byte = 0;
+static uint8_t s_uart_buffers[R_UART_RX_PORTS][R_OTA_PACKET_BUFFER_SIZE] = {0};
 
 /**
- * @brief Previous byte received over UART.
+ * @brief Reception ring buffer.
  *
- * Used to detect packet delimiters (end-of-frame = 0A0D).
+ * Written by the DMA (or by the RX interrupt) and drained by r_uart_process_rx().
+ * Split between the ports while listening on both UARTs.
+ */
+static uint8_t s_rx_ring[R_UART_RX_RING_SIZE] = {0};
+
+/**
+ * @brief Reception state of each UART, armed by r_uart_start_reception() or r_uart_start_listening().
+ */
+static R_UART_RX_PORT_ s_rx_ports[R_UART_RX_PORTS] = {0};
+
+/**
+ * @brief UART the packet in g_rx_buffer came from.
+ */
+static UART_HandleTypeDef *s_packet_uart = NULL;
+
+#if (R_UART_TX_MODE != R_UART_TX_MODE_BLOCKING)
+/**
+ * @brief Transmission queue, filled by r_uart_send() and drained by the interrupt or the DMA.
+ */
+static uint8_t s_tx_queue[R_UART_TX_QUEUE_SIZE] = {0};
+
+/**
+ * @brief Queue position of the next byte to be written by r_uart_send().
+ */
+static volatile uint16_t s_tx_head = 0;
+
+/**
+ * @brief Queue position of the first byte not sent yet.
  */
-static uint8_t s_last_byte = 0;
+static volatile uint16_t s_tx_tail = 0;
 
 /**
- * @brief Length of the payload currently being processed.
+ * @brief Bytes of the transfer in progress from s_tx_tail, 0 when the UART is idle.
  */
-static uint16_t s_len_payload = 0;
+static volatile uint16_t s_tx_busy = 0;
+
+/**
+ * @brief UART the queued bytes are sent through.
+ */
+static UART_HandleTypeDef *s_tx_uart = NULL;
+#endif
 
 /* USER CODE END PTD */
 
+// Start Private function prototypes ----------------------------------------------------------------------------------
+/**
+ * @brief Feed a run of received bytes to the OTA packet framer of a port.
+ *
+ * Bytes before an ETX_OTA_SOF are dropped, then the header is copied and
+ * checked and the rest of the frame is copied in one go up to the length
+ * it announces (see r_uart_framer_scan()).
+ *
+ * @param port   Port the bytes were received on.
+ * @param data   Received bytes.
+ * @param length Number of bytes.
+ * @return Bytes taken, fewer than length if a packet ended before the last one.
+ */
+static uint16_t r_uart_framer_push(R_UART_RX_PORT_ *port, const uint8_t *data, uint16_t length);
+
+/**
+ * @brief Check the bytes held by the framer of a port.
+ *
+ * A frame whose header is not one the bootloader takes, or whose length
+ * does not end in 0D0A, loses its SOF and the bytes held are searched for
+ * the next one, so a byte lost or corrupted costs that frame only. A good
+ * frame is copied into g_rx_buffer and sets s_packet_ready.
+ *
+ * @param port Port to check.
+ */
+static void r_uart_framer_scan(R_UART_RX_PORT_ *port);
+
+/**
+ * @brief Drop the first bytes held by the framer of a port, up to the next ETX_OTA_SOF.
+ *
+ * @param port  Port the bytes were received on.
+ * @param count Bytes dropped at least.
+ */
+static void r_uart_framer_drop(R_UART_RX_PORT_ *port, uint16_t count);
+
+/**
+ * @brief Get the length of the frame a header announces.
+ *
+ * @param header First R_UART_FRAME_HEADER bytes of the frame.
+ * @return Bytes of the whole frame, or 0 for an unknown packet type or a
+ *         length that does not fit in R_OTA_PACKET_BUFFER_SIZE.
+ */
+static uint16_t r_uart_frame_length(const uint8_t *header);
+
+/**
+ * @brief Arm the reception of a port over its piece of the ring, with an empty framer.
+ *
+ * @param port Port with its UART and ring piece set.
+ */
+static void r_uart_port_start(R_UART_RX_PORT_ *port);
+
+/**
+ * @brief Find the port a UART is armed on.
+ *
+ * @param huart UART of a HAL callback.
+ * @return The port, or NULL if the UART is not receiving.
+ */
+static R_UART_RX_PORT_ *r_uart_rx_port(UART_HandleTypeDef *huart);
+
+/**
+ * @brief Position of the next byte to be written by the reception of a port, read live.
+ *
+ * @param port Armed port.
+ * @return Head of the port ring.
+ */
+static uint16_t r_uart_rx_head(R_UART_RX_PORT_ *port);
+
+#if (R_UART_RX_MODE == R_UART_RX_MODE_FIFO)
+/**
+ * @brief Arm an interrupt reception to idle from the port head up to the end of its ring.
+ *
+ * @param port Armed port.
+ */
+static void r_uart_rx_fifo_arm(R_UART_RX_PORT_ *port);
+#endif
+
+#if (R_UART_TX_MODE != R_UART_TX_MODE_BLOCKING)
+/**
+ * @brief Start sending the queued bytes up to the end of the queue, unless a transfer is in progress.
+ *
+ * Called from r_uart_send() and from the transfer complete callback.
+ */
+static void r_uart_tx_start(void);
+#endif
+
+/**
+ * @brief Compute the BRR value and oversampling that reach a baud rate from the UART clock.
+ *
+ * 16x oversampling is kept unless 8x lands closer to the rate.
+ *
+ * @param huart        UART to configure.
+ * @param baud         Baud rate wanted.
+ * @param brr          Set to the BRR register value.
+ * @param oversampling Set to UART_OVERSAMPLING_16 or UART_OVERSAMPLING_8.
+ * @return HAL_OK, or HAL_ERROR if the rate is above R_OTA_BAUD_MAX or its error above R_OTA_BAUD_ERROR_PERMILLE.
+ */
+static HAL_StatusTypeDef r_uart_baud_brr(UART_HandleTypeDef *huart, uint32_t baud, uint32_t *brr, uint32_t *oversampling);
+// End Private function prototypes ------------------------------------------------------------------------------------
+
+// Start RECEPTION CONTROL --------------------------------------------------------------------------------------------
+void 
+r_uart_start_reception(UART_HandleTypeDef *huart)
+{
+		r_uart_stop_reception();
+
+		s_rx_ports[0].huart = huart;
+		s_rx_ports[0].ring = s_rx_ring;
+		s_rx_ports[0].size = R_UART_RX_RING_SIZE;
+		r_uart_port_start(&s_rx_ports[0]);
+}
+
+#if (R_UART_LISTEN_BOTH != 0)
 void 
-HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) 
+r_uart_start_listening(UART_HandleTypeDef *huart_a, UART_HandleTypeDef *huart_b)
+{
+		r_uart_stop_reception();
+
+		// Only session commands are expected before the bind: half of the ring each is plenty
+		s_rx_ports[0].huart = huart_a;
+		s_rx_ports[0].ring = s_rx_ring;
+		s_rx_ports[0].size = R_UART_RX_RING_SIZE / 2U;
+		r_uart_port_start(&s_rx_ports[0]);
+
+		s_rx_ports[1].huart = huart_b;
+		s_rx_ports[1].ring = &s_rx_ring[R_UART_RX_RING_SIZE / 2U];
+		s_rx_ports[1].size = R_UART_RX_RING_SIZE / 2U;
+		r_uart_port_start(&s_rx_ports[1]);
+}
+#endif
+
+UART_HandleTypeDef * 
+r_uart_bind(void)
 {
-    uint8_t byte = s_rx_byte;  // byte recibido por UART
+		UART_HandleTypeDef *huart = s_packet_uart;
+
+		// Nothing else is in flight: the host waits for the answer to the packet that binds
+		if((huart != NULL) && ((s_rx_ports[0].huart != huart) || (s_rx_ports[0].size != R_UART_RX_RING_SIZE)))
+		{
+			r_uart_start_reception(huart);
+		}
+
+		return huart;
+}
+
+void 
+r_uart_stop_reception(void)
+{
+		for(uint8_t i = 0; i < R_UART_RX_PORTS; i++)
+		{
+			if(s_rx_ports[i].huart != NULL)
+			{
+				HAL_UART_AbortReceive(s_rx_ports[i].huart);
+				s_rx_ports[i].huart = NULL;
+			}
+		}
+}
+
+void 
+r_uart_process_rx(void)
+{
+		for(uint8_t i = 0; (i < R_UART_RX_PORTS) && (s_packet_ready == 0); i++)
+		{
+			R_UART_RX_PORT_ *port = &s_rx_ports[i];
+			if(port->huart == NULL)
+			{
+				continue;
+			}
+
+			if(port->restart)
+			{
+				// The partial frame was lost with the aborted reception
+				port->restart = 0;
+				port->tail = 0;
+				port->index = 0;
+				port->len_frame = 0;
+			}
+
+			// Bytes held after a bad frame may hold the next packet already
+			r_uart_framer_scan(port);
+
+			// The DMA and FIFO receptions only report their position on idle line and ring events
+			uint16_t head = r_uart_rx_head(port);
+			uint8_t received = 0;
+
+			// Leave the bytes in the ring while the previous packet is still being processed
+			while((port->tail != head) && (s_packet_ready == 0))
+			{
+				// Up to the head or the end of the ring, the rest in the next pass
+				uint16_t n = (head > port->tail) ? (uint16_t)(head - port->tail) : (uint16_t)(port->size - port->tail);
+
+				port->tail += r_uart_framer_push(port, &port->ring[port->tail], n);
+				if(port->tail >= port->size)
+				{
+					port->tail = 0;
+				}
+				received = 1;
+			}
+
+			if(received)
+			{
+				port->tick = HAL_GetTick();
+			} else if(((port->index != 0) || (port->dropped != 0)) && (s_packet_ready == 0) &&
+								 ((HAL_GetTick() - port->tick) >= R_UART_FRAME_TIMEOUT_MS))
+			{
+				// Line quiet with a frame cut short or bytes dropped: one NACK, so the host does not wait for an answer
+				port->index = 0;
+				port->len_frame = 0;
+				port->dropped = 0;
+				s_packet_uart = port->huart;
+				s_frame_error = 1;
+				s_packet_ready = 1;
+			}
+		}
+
+		r_uart_flow_control();
+}
+
+void 
+r_uart_flow_control(void)
+{
+#if ((R_UART_FLOW_CONTROL & UART_HWCONTROL_RTS) != 0)
+		for(uint8_t i = 0; i < R_UART_RX_PORTS; i++)
+		{
+			R_UART_RX_PORT_ *port = &s_rx_ports[i];
+			if(port->huart == NULL)
+			{
+				continue;
+			}
+
+			// The room scales with the piece of the ring the port has
+			uint16_t head = r_uart_rx_head(port);
+			uint16_t used = (uint16_t)((head + port->size - port->tail) % port->size);
+			uint16_t room = (uint16_t)(port->size - 1U - used);
+			uint16_t room_min = (uint16_t)(((uint32_t)R_UART_RTS_ROOM * port->size) / R_UART_RX_RING_SIZE);
+
+			if((port->paused == 0) && (room < room_min))
+			{
+				// Nobody reads the data register any more: once it (or the FIFO) is full the USART deasserts RTS
+#if (R_UART_RX_MODE == R_UART_RX_MODE_DMA)
+				ATOMIC_CLEAR_BIT(port->huart->Instance->CR3, USART_CR3_DMAR);
+#else
+				uint32_t primask = __get_PRIMASK();
+				__disable_irq();
+
+				// Byte, FIFO threshold and idle interrupts, whichever the reception in progress uses
+				port->paused_cr1 = READ_BIT(port->huart->Instance->CR1, USART_CR1_RXNEIE_RXFNEIE | USART_CR1_IDLEIE);
+				port->paused_cr3 = READ_BIT(port->huart->Instance->CR3, USART_CR3_RXFTIE);
+				CLEAR_BIT(port->huart->Instance->CR1, port->paused_cr1);
+				CLEAR_BIT(port->huart->Instance->CR3, port->paused_cr3);
+
+				__set_PRIMASK(primask);
+#endif
+				port->paused = 1;
+
+			} else if((port->paused != 0) && (room >= (2U * room_min)))
+			{
+#if (R_UART_RX_MODE == R_UART_RX_MODE_DMA)
+				ATOMIC_SET_BIT(port->huart->Instance->CR3, USART_CR3_DMAR);
+#else
+				ATOMIC_SET_BIT(port->huart->Instance->CR1, port->paused_cr1);
+				ATOMIC_SET_BIT(port->huart->Instance->CR3, port->paused_cr3);
+#endif
+				port->paused = 0;
+			}
+		}
+#endif
+}
+
+static void 
+r_uart_port_start(R_UART_RX_PORT_ *port)
+{
+		port->buffer = s_uart_buffers[port - s_rx_ports];
+		port->head = 0;
+		port->tail = 0;
+		port->restart = 0;
+
+		// A frame cut by a previous reception is not completed with the new bytes
+		port->index = 0;
+		port->len_frame = 0;
+		port->dropped = 0;
+#if ((R_UART_FLOW_CONTROL & UART_HWCONTROL_RTS) != 0)
+		port->paused = 0;
+#endif
+
+#if (R_UART_RX_MODE == R_UART_RX_MODE_DMA)
+		// Circular DMA: the HAL reports the write position on half, full and idle-line events
+		HAL_UARTEx_ReceiveToIdle_DMA(port->huart, port->ring, port->size);
+#elif (R_UART_RX_MODE == R_UART_RX_MODE_FIFO)
+		r_uart_rx_fifo_arm(port);
+#else
+		HAL_UART_Receive_IT(port->huart, (uint8_t *)&port->rx_byte, 1);
+#endif
+}
+
+static R_UART_RX_PORT_ * 
+r_uart_rx_port(UART_HandleTypeDef *huart)
+{
+		for(uint8_t i = 0; i < R_UART_RX_PORTS; i++)
+		{
+			if((huart != NULL) && (s_rx_ports[i].huart == huart))
+			{
+				return &s_rx_ports[i];
+			}
+		}
+
+		return NULL;
+}
+
+static uint16_t 
+r_uart_rx_head(R_UART_RX_PORT_ *port)
+{
+#if (R_UART_RX_MODE == R_UART_RX_MODE_DMA)
+		uint16_t head = (uint16_t)(port->size - __HAL_DMA_GET_COUNTER(port->huart->hdmarx));
+#elif (R_UART_RX_MODE == R_UART_RX_MODE_FIFO)
+		// Start of the reception plus the bytes the interrupt stored, both changed by the callbacks
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		uint16_t head = (uint16_t)(port->head + (port->huart->RxXferSize - port->huart->RxXferCount));
+		__set_PRIMASK(primask);
+#else
+		uint16_t head = port->head;
+#endif
+		if(head >= port->size)
+		{
+			head = 0;
+		}
+
+		return head;
+}
+
+#if (R_UART_RX_MODE == R_UART_RX_MODE_FIFO)
+static void 
+r_uart_rx_fifo_arm(R_UART_RX_PORT_ *port)
+{
+		// Interrupt reception is not circular: it ends on idle line or at the end of the ring and is re-armed
+		HAL_UARTEx_ReceiveToIdle_IT(port->huart, &port->ring[port->head], (uint16_t)(port->size - port->head));
+}
+#endif
+// End RECEPTION CONTROL ----------------------------------------------------------------------------------------------
+
+// Start TRANSMISSION -------------------------------------------------------------------------------------------------
+void 
+r_uart_send(UART_HandleTypeDef *huart, const uint8_t *data, uint16_t length)
+{
+#if (R_UART_TX_MODE == R_UART_TX_MODE_BLOCKING)
+		HAL_UART_Transmit(huart, data, length, HAL_MAX_DELAY);
+#else
+		if(huart != s_tx_uart)
+		{
+			r_uart_flush_tx();
+			s_tx_uart = huart;
+		}
 		
-    s_uart_buffer[s_uart_index] = byte;
-		s_uart_index++;
+		while(length > 0)
+		{
+			// One byte is always left free, so head == tail only when the queue is empty
+			uint16_t head = s_tx_head;
+			uint16_t used = (uint16_t)((head + R_UART_TX_QUEUE_SIZE - s_tx_tail) % R_UART_TX_QUEUE_SIZE);
+			uint16_t room = (uint16_t)(R_UART_TX_QUEUE_SIZE - 1U - used);
+			
+			if(room == 0)
+			{
+				r_uart_tx_start();
+				continue;		// Full: wait for the transfer in progress to free some room
+			}
+			
+			uint16_t n = length;
+			if(n > room)
+			{
+				n = room;
+			}
+			if(n > (R_UART_TX_QUEUE_SIZE - head))
+			{
+				n = (uint16_t)(R_UART_TX_QUEUE_SIZE - head);
+			}
+			
+			memcpy_s(&s_tx_queue[head], R_UART_TX_QUEUE_SIZE - head, data, n);
+			s_tx_head = (uint16_t)((head + n) % R_UART_TX_QUEUE_SIZE);
+			data += n;
+			length -= n;
+			
+			r_uart_tx_start();
+		}
+#endif
+}
+
+void 
+r_uart_send_listening(const uint8_t *data, uint16_t length)
+{
+		for(uint8_t i = 0; i < R_UART_RX_PORTS; i++)
+		{
+			if(s_rx_ports[i].huart != NULL)
+			{
+				r_uart_send(s_rx_ports[i].huart, data, length);
+			}
+		}
+}
+
+void 
+r_uart_flush_tx(void)
+{
+#if (R_UART_TX_MODE != R_UART_TX_MODE_BLOCKING)
+		while((s_tx_head != s_tx_tail) || (s_tx_busy != 0))
+		{
+			r_uart_tx_start();
+		}
+#endif
+}
+
+#if (R_UART_TX_MODE != R_UART_TX_MODE_BLOCKING)
+static void 
+r_uart_tx_start(void)
+{
+		// Also run from the transfer complete interrupt: only one of them may start the next transfer
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
 		
-		if(s_uart_index == 4)
+		uint16_t tail = s_tx_tail;
+		uint16_t head = s_tx_head;
+		if((s_tx_busy == 0) && (head != tail) && (s_tx_uart != NULL))
 		{
-			s_len_payload = s_uart_buffer[2] | (s_uart_buffer[3] << 8);
-			s_len_payload += 4;
+			// Up to the end of the queue, the rest goes in the next transfer
+			uint16_t n = (head > tail) ? (uint16_t)(head - tail) : (uint16_t)(R_UART_TX_QUEUE_SIZE - tail);
+			s_tx_busy = n;
 			
-		} else 
+#if (R_UART_TX_MODE == R_UART_TX_MODE_DMA)
+			HAL_StatusTypeDef status = HAL_UART_Transmit_DMA(s_tx_uart, &s_tx_queue[tail], n);
+#else
+			HAL_StatusTypeDef status = HAL_UART_Transmit_IT(s_tx_uart, &s_tx_queue[tail], n);
+#endif
+			if(status != HAL_OK)
+			{
+				s_tx_busy = 0;		// UART still busy: retried on the next call
+			}
+		}
+		
+		__set_PRIMASK(primask);
+}
+#endif
+// End TRANSMISSION ---------------------------------------------------------------------------------------------------
+
+// Start BAUD RATE ----------------------------------------------------------------------------------------------------
+HAL_StatusTypeDef 
+r_uart_baud_check(UART_HandleTypeDef *huart, uint32_t baud)
+{
+		uint32_t brr;
+		uint32_t oversampling;
+		
+		return r_uart_baud_brr(huart, baud, &brr, &oversampling);
+}
+
+HAL_StatusTypeDef 
+r_uart_set_baud(UART_HandleTypeDef *huart, uint32_t baud)
+{
+		uint32_t brr;
+		uint32_t oversampling;
+		
+		if(r_uart_baud_brr(huart, baud, &brr, &oversampling) != HAL_OK)
 		{
-			if(s_len_payload > 0)
+			return HAL_ERROR;
+		}
+		
+		// The last response still goes out at the previous rate
+		r_uart_flush_tx();
+		
+		R_UART_RX_PORT_ *port = r_uart_rx_port(huart);
+		if(port != NULL)
+		{
+			HAL_UART_AbortReceive(huart);
+		}
+		
+		// BRR and OVER8 are only written with the UART disabled
+		__HAL_UART_DISABLE(huart);
+		MODIFY_REG(huart->Instance->CR1, USART_CR1_OVER8, oversampling);
+		huart->Instance->BRR = brr;
+		huart->Init.BaudRate = baud;
+		huart->Init.OverSampling = oversampling;
+		__HAL_UART_ENABLE(huart);
+		
+		// Whatever arrived during the switch is dropped with the ring
+		if(port != NULL)
+		{
+			r_uart_port_start(port);
+		}
+		
+		return HAL_OK;
+}
+
+HAL_StatusTypeDef 
+r_uart_clock_changed(void)
+{
+		HAL_StatusTypeDef status = HAL_OK;
+		
+		// Same baud rates, BRR values from the new clock
+		for(uint8_t i = 0; i < R_UART_RX_PORTS; i++)
+		{
+			UART_HandleTypeDef *huart = s_rx_ports[i].huart;
+			if((huart != NULL) && (r_uart_set_baud(huart, huart->Init.BaudRate) != HAL_OK))
 			{
-				s_len_payload--;
-				
-			} else	
+				status = HAL_ERROR;
+			}
+		}
+		
+		return status;
+}
+
+static HAL_StatusTypeDef 
+r_uart_baud_brr(UART_HandleTypeDef *huart, uint32_t baud, uint32_t *brr, uint32_t *oversampling)
+{
+		if((baud == 0) || (baud > R_OTA_BAUD_MAX))
+		{
+			return HAL_ERROR;
+		}
+		
+		uint32_t clock = HAL_RCCEx_GetPeriphCLKFreq((huart->Instance == USART1) ? RCC_PERIPHCLK_USART1 : RCC_PERIPHCLK_USART2);
+		clock /= UARTPrescTable[huart->Init.ClockPrescaler];
+		
+		uint32_t best_error = 0xFFFFFFFFU;
+		
+		// 16x first, it tolerates more noise; 8x only when it lands closer to the rate
+		for(uint32_t samples = 16U; samples >= 8U; samples -= 8U)
+		{
+			uint32_t div = ((clock * (16U / samples)) + (baud / 2U)) / baud;
+			if((div < R_UART_BRR_MIN) || (div > R_UART_BRR_MAX))
 			{
-				if ((s_last_byte == ETX_OTA_SALTO_LINEA) && (byte == ETX_OTA_FIN_LINEA)) 
-				{  // fin de paquete
-						s_packet_ready = 1;
-					
+				continue;
+			}
+			
+			uint32_t reached = (clock * (16U / samples)) / div;
+			uint32_t error = (reached > baud) ? (reached - baud) : (baud - reached);
+			if(error < best_error)
+			{
+				best_error = error;
+				if(samples == 16U)
+				{
+					*oversampling = UART_OVERSAMPLING_16;
+					*brr = div;
+				} else
+				{
+					// 8x oversampling: BRR[2:0] holds the fraction shifted right by one
+					*oversampling = UART_OVERSAMPLING_8;
+					*brr = (div & 0xFFF0U) | ((div & 0x000FU) >> 1U);
 				}
 			}
 		}
 		
-		s_last_byte = byte; // actualizar ltimo byte recibido
-		
-		//HAL_UART_Transmit(&huart2, &byte, 1, HAL_MAX_DELAY);
+		if(((uint64_t)best_error * 1000U) > ((uint64_t)baud * R_OTA_BAUD_ERROR_PERMILLE))
+		{
+			return HAL_ERROR;
+		}
 		
-		if(s_packet_ready)
+		return HAL_OK;
+}
+// End BAUD RATE ------------------------------------------------------------------------------------------------------
+
+// Start HAL CALLBACKS ------------------------------------------------------------------------------------------------
+void 
+HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+		R_UART_RX_PORT_ *port = r_uart_rx_port(huart);
+		if(port == NULL)
 		{
-			memcpy_s((void*)g_rx_buffer, ETX_OTA_PACKET_MAX_SIZE,(void*)s_uart_buffer, s_uart_index);
+			return;
+		}
+
+		port->ring[port->head] = port->rx_byte;  // byte recibido por UART
 
-			s_uart_index = 0;
-			//s_packet_ready = 0;
+		uint16_t next_head = port->head + 1;
+		if(next_head >= port->size)
+		{
+			next_head = 0;
 		}
+		port->head = next_head;
 
     // reactivar la interrupcin para siguiente byte
-    HAL_UART_Receive_IT(huart, (uint8_t *)&s_rx_byte, 1);
-}
\ No newline at end of file
+    HAL_UART_Receive_IT(huart, (uint8_t *)&port->rx_byte, 1);
+}
+
+void 
+HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+#if (R_UART_TX_MODE != R_UART_TX_MODE_BLOCKING)
+		if(huart != s_tx_uart)
+		{
+			return;
+		}
+		
+		s_tx_tail = (uint16_t)((s_tx_tail + s_tx_busy) % R_UART_TX_QUEUE_SIZE);
+		s_tx_busy = 0;
+		r_uart_tx_start();
+#endif
+}
+
+void 
+HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+		R_UART_RX_PORT_ *port = r_uart_rx_port(huart);
+		if(port == NULL)
+		{
+			return;
+		}
+
+#if (R_UART_RX_MODE == R_UART_RX_MODE_FIFO)
+		// Size counts from the start of the reception, which has ended: continue after it
+		uint16_t head = (uint16_t)(port->head + Size);
+		port->head = (head >= port->size) ? 0 : head;
+		r_uart_rx_fifo_arm(port);
+#else
+		// Size is the DMA write position inside the port ring (its size on the full event)
+		port->head = (Size >= port->size) ? 0 : Size;
+#endif
+}
+
+void 
+HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+		R_UART_RX_PORT_ *port = r_uart_rx_port(huart);
+		if(port == NULL)
+		{
+			return;
+		}
+
+		// Overrun/noise/framing errors abort the reception: re-arm it from the start of the ring
+#if (R_UART_RX_MODE == R_UART_RX_MODE_DMA)
+		HAL_UART_AbortReceive(huart);
+		port->head = 0;
+		port->restart = 1;
+		HAL_UARTEx_ReceiveToIdle_DMA(huart, port->ring, port->size);
+#if ((R_UART_FLOW_CONTROL & UART_HWCONTROL_RTS) != 0)
+		port->paused = 0;
+#endif
+#elif (R_UART_RX_MODE == R_UART_RX_MODE_FIFO)
+		// Noise/framing errors leave the reception running (the packet CRC rejects the byte),
+		// an overrun ends it: keep what it stored and re-arm after it
+		if(huart->RxState == HAL_UART_STATE_READY)
+		{
+			uint16_t head = (uint16_t)(port->head + (huart->RxXferSize - huart->RxXferCount));
+			port->head = (head >= port->size) ? 0 : head;
+			r_uart_rx_fifo_arm(port);
+		}
+#else
+		HAL_UART_Receive_IT(huart, (uint8_t *)&port->rx_byte, 1);
+#endif
+}
+// End HAL CALLBACKS --------------------------------------------------------------------------------------------------
+
+// Start FRAMER -------------------------------------------------------------------------------------------------------
+static uint16_t 
+r_uart_framer_push(R_UART_RX_PORT_ *port, const uint8_t *data, uint16_t length)
+{
+		uint16_t used = 0;
+		
+		while((used < length) && (s_packet_ready == 0))
+		{
+			if(port->index == 0)
+			{
+				// Hunting for the start of a frame: anything else is line noise or the rest of a bad frame
+				while((used < length) && (data[used] != ETX_OTA_SOF))
+				{
+					used++;
+					port->dropped = 1;
+				}
+				if(used == length)
+				{
+					break;
+				}
+			}
+			
+			// The header first, to check it, then the rest of the frame in one go
+			uint16_t n = (port->len_frame != 0) ? (uint16_t)(port->len_frame - port->index) : (uint16_t)(R_UART_FRAME_HEADER - port->index);
+			if(n > (length - used))
+			{
+				n = (uint16_t)(length - used);
+			}
+			
+			memcpy_s(&port->buffer[port->index], R_OTA_PACKET_BUFFER_SIZE - port->index, &data[used], n);
+			port->index += n;
+			used += n;
+			
+			r_uart_framer_scan(port);
+		}
+		
+		return used;
+}
+
+static void 
+r_uart_framer_scan(R_UART_RX_PORT_ *port)
+{
+		while(s_packet_ready == 0)
+		{
+			if(port->len_frame == 0)
+			{
+				if(port->index < R_UART_FRAME_HEADER)
+				{
+					return;
+				}
+				
+				port->len_frame = r_uart_frame_length(port->buffer);
+				if(port->len_frame == 0)
+				{
+					// Corrupted type or length, or a '$' that was not a SOF
+					r_uart_framer_drop(port, 1);
+					port->dropped = 1;
+					continue;
+				}
+			}
+			
+			if(port->index < port->len_frame)
+			{
+				return;
+			}
+			
+			if((port->buffer[port->len_frame - 2U] != ETX_OTA_SALTO_LINEA) || (port->buffer[port->len_frame - 1U] != ETX_OTA_FIN_LINEA))
+			{
+				// The length does not lead to the end of frame: a byte was lost or the length is corrupted
+				r_uart_framer_drop(port, 1);
+				port->dropped = 1;
+				continue;
+			}
+			
+			memcpy_s((void*)g_rx_buffer, R_OTA_PACKET_BUFFER_SIZE, (void*)port->buffer, port->len_frame);
+			s_packet_uart = port->huart;
+			s_packet_ready = 1;
+			
+			// The host gets an answer to this packet, the bytes dropped before it need no NACK
+			port->dropped = 0;
+			r_uart_framer_drop(port, port->len_frame);
+		}
+}
+
+static void 
+r_uart_framer_drop(R_UART_RX_PORT_ *port, uint16_t count)
+{
+		// Nothing before the next SOF can start a frame either
+		while((count < port->index) && (port->buffer[count] != ETX_OTA_SOF))
+		{
+			count++;
+			port->dropped = 1;
+		}
+		
+		if(count < port->index)
+		{
+			memmove_s(port->buffer, R_OTA_PACKET_BUFFER_SIZE, &port->buffer[count], port->index - count);
+		}
+		port->index -= count;
+		port->len_frame = 0;
+}
+
+static uint16_t 
+r_uart_frame_length(const uint8_t *header)
+{
+		uint8_t type = header[ETX_OTA_PACKET_TYPE_SECTOR];
+		uint32_t length = (uint32_t)header[2] | ((uint32_t)header[3] << 8);
+		
+		// Only the host packets, the responses are never received
+		if((type > ETX_OTA_PACKET_TYPE_CODED) || (type == ETX_OTA_PACKET_TYPE_RESPONSE) || (length == 0))
+		{
+			return 0;
+		}
+		
+		length += R_UART_FRAME_HEADER + R_UART_FRAME_TRAILER;
+		if(ETX_OTA_PACKET_HAS_SEQ(type))
+		{
+			length += ETX_OTA_DATA_SEQ_SIZE; // Len does not count the sequence number
+		}
+		
+		return (length <= R_OTA_PACKET_BUFFER_SIZE) ? (uint16_t)length : 0;
+}
+// End FRAMER ---------------------------------------------------------------------------------------------------------
@@ -0,0 +1,63 @@
+/**
+ * @file r_delta.h
+ * @brief Streaming decoder for pages sent as a delta of the installed image.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 17/10/2026
+ *
+ */
+
+#ifndef R_DELTA_H
+#define R_DELTA_H
+
+#include "main.h"
+#include "stdint.h"
+
+/**
+ * @brief Decoder state kept between two calls (an operation may straddle two packets).
+ */
+typedef struct
+{
+    uint8_t  op[6];         /**< Bytes of the operation being read. */
+    uint8_t  op_len;        /**< Bytes already in @ref op. */
+    uint16_t literal;       /**< Literal bytes still to be copied from the input. */
+    int32_t  shift;         /**< Installed image offset - new image offset of the last copy. */
+} R_DELTA_CTX_;
+
+/**
+ * @brief Where the installed image can be read from.
+ */
+typedef struct
+{
+    const uint8_t *image;   /**< First byte of the installed image. */
+    uint32_t       start;   /**< First offset that may be read (the rest was already overwritten). */
+    uint32_t       end;     /**< End of the readable region. */
+} R_DELTA_SRC_;
+
+/**
+ * @brief Start decoding a new page.
+ *
+ * @param ctx   Context to initialize.
+ */
+void r_delta_init(R_DELTA_CTX_ *ctx);
+
+/**
+ * @brief Decode part of a page.
+ *
+ * Copies read the installed image through @p src, and must fall inside
+ * [start, end): the host only refers to pages not yet overwritten.
+ *
+ * @param ctx      Decoder state.
+ * @param src      Installed image.
+ * @param in       Delta bytes.
+ * @param in_len   Delta bytes available, updated with the bytes consumed.
+ * @param out      Page buffer.
+ * @param out_base Image offset of out[0].
+ * @param out_pos  Next position to write in @p out, updated.
+ * @param out_size End of the output (bytes the page must produce).
+ * @return HAL_OK, or HAL_ERROR on an invalid operation or a copy outside @p src.
+ */
+HAL_StatusTypeDef r_delta_decode(R_DELTA_CTX_ *ctx, const R_DELTA_SRC_ *src, const uint8_t *in, uint16_t *in_len,
+                                 uint8_t *out, uint32_t out_base, uint16_t *out_pos, uint16_t out_size);
+
+#endif // R_DELTA_H
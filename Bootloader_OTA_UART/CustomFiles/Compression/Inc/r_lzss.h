@@ -0,0 +1,51 @@
+/**
+ * @file r_lzss.h
+ * @brief Streaming LZSS decoder for compressed firmware pages.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 17/10/2026
+ *
+ */
+
+#ifndef R_LZSS_H
+#define R_LZSS_H
+
+#include "main.h"
+#include "stdint.h"
+
+/**
+ * @brief Decoder state kept between two calls (a token may straddle two packets).
+ */
+typedef struct
+{
+    uint8_t flags;          /**< Flag byte being consumed, LSB first. */
+    uint8_t flag_bits;      /**< Flag bits left in @ref flags. */
+    uint8_t token_low;      /**< First byte of a match token. */
+    uint8_t token_half;     /**< 1 when @ref token_low holds the first byte of a match. */
+} R_LZSS_CTX_;
+
+/**
+ * @brief Start decoding a new stream.
+ *
+ * @param ctx   Context to initialize.
+ */
+void r_lzss_init(R_LZSS_CTX_ *ctx);
+
+/**
+ * @brief Decode part of a stream.
+ *
+ * The output buffer is also the history: matches copy bytes already
+ * decoded into out[0..*out_pos), so no window is kept in the context.
+ * Decoding stops when the input is consumed or the output is full.
+ *
+ * @param ctx      Decoder state.
+ * @param in       Compressed bytes.
+ * @param in_len   Compressed bytes available, updated with the bytes consumed.
+ * @param out      Output buffer, decoded since its first byte.
+ * @param out_pos  Next position to write in @p out, updated.
+ * @param out_size End of the output (bytes the stream must produce).
+ * @return HAL_OK, or HAL_ERROR on a match outside the decoded bytes.
+ */
+HAL_StatusTypeDef r_lzss_decode(R_LZSS_CTX_ *ctx, const uint8_t *in, uint16_t *in_len, uint8_t *out, uint16_t *out_pos, uint16_t out_size);
+
+#endif // R_LZSS_H
@@ -0,0 +1,108 @@
+/**
+ * @file r_delta.c
+ * @brief Streaming decoder for pages sent as a delta of the installed image.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 17/10/2026
+ *
+ * @details
+ * Stream format (see ETX_OTA_PACKET_TYPE_DATA_DELTA), a list of operations:
+ * - First byte: kind in the 2 high bits, length - 1 in the 6 low bits.
+ *   ETX_OTA_DELTA_LEN_EXT in the low bits means the length follows as
+ *   2 bytes, little endian.
+ * - ETX_OTA_DELTA_LITERAL: the length bytes follow.
+ * - ETX_OTA_DELTA_COPY: a 3-byte installed image offset follows, the bytes
+ *   are copied from there.
+ * - ETX_OTA_DELTA_COPY_SAME: copy with the same displacement (installed
+ *   offset - new offset) as the last copy, 0 at the start of the page.
+ *   Code shifted by an insertion is a run of these with a few literals
+ *   for the changed addresses.
+ *
+ * The image is rebuilt in place, page by page: a page may only refer to
+ * the installed image from its own page on, which is still intact.
+ */
+
+#include "r_delta.h"
+#include "r_ota_structure.h"
+#include "safe_mem_lib.h"
+
+// Start DECODER ------------------------------------------------------------------------------------------------------
+void 
+r_delta_init(R_DELTA_CTX_ *ctx)
+{
+    ctx->op_len = 0;
+    ctx->literal = 0;
+    ctx->shift = 0;
+}
+
+HAL_StatusTypeDef 
+r_delta_decode(R_DELTA_CTX_ *ctx, const R_DELTA_SRC_ *src, const uint8_t *in, uint16_t *in_len,
+               uint8_t *out, uint32_t out_base, uint16_t *out_pos, uint16_t out_size)
+{
+    uint16_t used = 0;
+    uint16_t pos = *out_pos;
+    HAL_StatusTypeDef status = HAL_OK;
+
+    while ((used < *in_len) && (pos < out_size))
+		{
+        if (ctx->literal > 0U)
+				{
+            out[pos++] = in[used++];
+            ctx->literal--;
+            continue;
+        }
+
+        ctx->op[ctx->op_len++] = in[used++];
+
+        uint8_t kind = ctx->op[0] >> ETX_OTA_DELTA_KIND_SHIFT;
+        uint8_t extended = ((ctx->op[0] & ETX_OTA_DELTA_LEN_EXT) == ETX_OTA_DELTA_LEN_EXT);
+        uint8_t need = 1U + (extended ? 2U : 0U) + ((kind == ETX_OTA_DELTA_COPY) ? 3U : 0U);
+
+        if (ctx->op_len < need)
+				{
+            continue;
+        }
+        ctx->op_len = 0;
+
+        uint16_t length = extended ? (uint16_t)(ctx->op[1] | ((uint16_t)ctx->op[2] << 8)) : ((ctx->op[0] & ETX_OTA_DELTA_LEN_EXT) + 1U);
+        if ((length == 0U) || (length > (out_size - pos)))
+				{
+            status = HAL_ERROR;
+            break;
+        }
+
+        if (kind == ETX_OTA_DELTA_LITERAL)
+				{
+            ctx->literal = length;
+            continue;
+        }
+
+        int32_t new_offset = (int32_t)(out_base + pos);
+        if (kind == ETX_OTA_DELTA_COPY)
+				{
+            const uint8_t *offset = &ctx->op[extended ? 3 : 1];
+            ctx->shift = (int32_t)(offset[0] | ((uint32_t)offset[1] << 8) | ((uint32_t)offset[2] << 16)) - new_offset;
+        } else if (kind != ETX_OTA_DELTA_COPY_SAME)
+				{
+            status = HAL_ERROR;
+            break;
+        }
+
+				// Only from the part of the installed image not overwritten yet
+        int32_t from = new_offset + ctx->shift;
+        if ((from < (int32_t)src->start) || ((uint32_t)from + length > src->end))
+				{
+            status = HAL_ERROR;
+            break;
+        }
+
+        memcpy_s(&out[pos], out_size - pos, &src->image[from], length);
+        pos += length;
+    }
+
+    *in_len = used;
+    *out_pos = pos;
+
+    return status;
+}
+// End DECODER --------------------------------------------------------------------------------------------------------
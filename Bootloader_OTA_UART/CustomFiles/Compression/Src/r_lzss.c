@@ -0,0 +1,93 @@
+/**
+ * @file r_lzss.c
+ * @brief Streaming LZSS decoder for compressed firmware pages.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 17/10/2026
+ *
+ * @details
+ * Stream format (see ETX_OTA_PACKET_TYPE_DATA_LZ):
+ * - A flag byte announces the next 8 items, LSB first.
+ * - Flag bit 1: one literal byte.
+ * - Flag bit 0: a match of 2 bytes, little endian. The low
+ *   ETX_OTA_LZ_DIST_BITS bits hold the distance - 1 and the high bits
+ *   the length - ETX_OTA_LZ_MIN_MATCH.
+ *
+ * Every flash page is compressed on its own, so the page being assembled
+ * is the whole history and the decoder needs no RAM of its own.
+ */
+
+#include "r_lzss.h"
+#include "r_ota_structure.h"
+
+// Start DECODER ------------------------------------------------------------------------------------------------------
+void 
+r_lzss_init(R_LZSS_CTX_ *ctx)
+{
+    ctx->flags = 0;
+    ctx->flag_bits = 0;
+    ctx->token_low = 0;
+    ctx->token_half = 0;
+}
+
+HAL_StatusTypeDef 
+r_lzss_decode(R_LZSS_CTX_ *ctx, const uint8_t *in, uint16_t *in_len, uint8_t *out, uint16_t *out_pos, uint16_t out_size)
+{
+    uint16_t used = 0;
+    uint16_t pos = *out_pos;
+    HAL_StatusTypeDef status = HAL_OK;
+
+    while ((used < *in_len) && (pos < out_size))
+		{
+        uint8_t byte = in[used++];
+
+        if (ctx->token_half)
+				{
+						// Second byte of a match token
+            uint16_t token = ctx->token_low | ((uint16_t)byte << 8);
+            uint16_t distance = (token & ((1U << ETX_OTA_LZ_DIST_BITS) - 1U)) + 1U;
+            uint16_t length = (token >> ETX_OTA_LZ_DIST_BITS) + ETX_OTA_LZ_MIN_MATCH;
+
+            ctx->token_half = 0;
+
+            if (distance > pos)
+						{
+                status = HAL_ERROR;
+                break;
+            }
+
+						// Byte by byte: the source may overlap the bytes being written
+            while ((length > 0U) && (pos < out_size))
+						{
+                out[pos] = out[pos - distance];
+                pos++;
+                length--;
+            }
+            continue;
+        }
+
+        if (ctx->flag_bits == 0U)
+				{
+            ctx->flags = byte;
+            ctx->flag_bits = 8;
+            continue;
+        }
+
+        ctx->flag_bits--;
+        if (ctx->flags & 0x01U)
+				{
+            out[pos++] = byte;
+        } else
+				{
+            ctx->token_low = byte;
+            ctx->token_half = 1;
+        }
+        ctx->flags >>= 1;
+    }
+
+    *in_len = used;
+    *out_pos = pos;
+
+    return status;
+}
+// End DECODER --------------------------------------------------------------------------------------------------------
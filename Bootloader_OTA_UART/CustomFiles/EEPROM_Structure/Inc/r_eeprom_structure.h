@@ -20,6 +20,26 @@
 
 #define EEPROM_MAGIC					0x4ED177EC
 
+#define JOURNAL_MAGIC					0x4A524E4C
+
+/**
+ * @brief Update journal header, stored at OTA_JOURNAL_ADDRESS.
+ *
+ * Identifies the image being received. It is followed by one double
+ * word per committed page: the page index in the low word and its
+ * complement in the high word, written in page order.
+ */
+typedef struct 
+{
+		uint32_t magic;
+		uint32_t package_size;
+		uint32_t package_crc;
+		uint32_t check;			// ~package_size
+} EEPROM_Journal_Header;
+
+/** Pages the journal can record after its 16-byte header, up to the end of the EEPROM page. */
+#define JOURNAL_MAX_PAGES			((EEPROM_ADDRESS + FLASH_PAGE_SIZE - OTA_JOURNAL_ADDRESS - 16U) / 8U)
+
 typedef struct 
 {
 		uint32_t magic;
@@ -68,4 +88,36 @@ void r_write_eeprom_data(EEPROM_Emu_Data* ee_new_data);
  */
 void r_set_eeprom_flags(uint32_t flag_up, uint32_t flag_bu, uint32_t version, uint32_t rs, uint32_t crc);
 
+/**
+ * @brief Count the pages committed to the journal for an image.
+ *
+ * Pages are counted from the first one while their marks are valid.
+ *
+ * @param[in] size  Image size announced in the header packet.
+ * @param[in] crc   Image CRC announced in the header packet.
+ * @return Committed pages, 0 if the journal belongs to another image.
+ */
+uint32_t r_read_journal_pages(uint32_t size, uint32_t crc);
+
+/**
+ * @brief Start a new journal for an image.
+ *
+ * Rewrites the EEPROM page, which drops the previous journal, and
+ * programs the header of the new one.
+ *
+ * @param[in] size  Image size announced in the header packet.
+ * @param[in] crc   Image CRC announced in the header packet.
+ */
+void r_start_journal(uint32_t size, uint32_t crc);
+
+/**
+ * @brief Record a page as programmed and verified.
+ *
+ * Only programs one double word, so it can run between two background
+ * page writes without erasing the EEPROM page.
+ *
+ * @param[in] page  Page index from APP_A_ADDRESS.
+ */
+void r_commit_journal_page(uint32_t page);
+
 #endif // R_EEPROM_STRUCTURE_H
\ No newline at end of file
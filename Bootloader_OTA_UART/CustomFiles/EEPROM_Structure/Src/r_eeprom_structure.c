@@ -17,6 +17,10 @@
  * - Firmware size received,
  * - Firmware CRC.
  *
+ * The rest of the page holds the update journal (see OTA_JOURNAL_ADDRESS):
+ * the image being received and the pages already programmed, so an
+ * interrupted update can resume where it stopped.
+ *
  * These values are used during the firmware update and bootloader processes
  * to validate firmware integrity and manage update states.
  */
@@ -24,6 +28,11 @@
 #include "string.h"
 
 #include "r_eeprom_structure.h"
+#include "r_flash_functions.h"
+
+#if (JOURNAL_MAX_PAGES < (APP_MAX_SIZE / FLASH_PAGE_SIZE))
+#error "The update journal does not fit the application pages in the EEPROM page"
+#endif
 
 //Init EEPROM if not initialized
 void 
@@ -104,4 +113,71 @@ r_set_eeprom_flags(uint32_t flag_up, uint32_t flag_bu, uint32_t version, uint32_
 			ee_current.fw_crc = crc;
 	}
 	r_write_eeprom_data(&ee_current);
+}
+
+//Get the pages already committed for an image
+uint32_t 
+r_read_journal_pages(uint32_t size, uint32_t crc)
+{
+	const EEPROM_Journal_Header *header = (const EEPROM_Journal_Header *)OTA_JOURNAL_ADDRESS;
+	const uint32_t *mark = (const uint32_t *)(OTA_JOURNAL_ADDRESS + sizeof(EEPROM_Journal_Header));
+	uint32_t pages = 0;
+	
+	if((header->magic != JOURNAL_MAGIC) || (header->package_size != size) || 
+		 (header->package_crc != crc) || (header->check != ~size))
+	{
+			return 0;
+	}
+	
+	while((pages < JOURNAL_MAX_PAGES) && (mark[0] == pages) && (mark[1] == ~pages))
+	{
+			pages++;
+			mark += 2;
+	}
+	return pages;
+}
+
+//Start the journal of a new image
+void 
+r_start_journal(uint32_t size, uint32_t crc)
+{
+	EEPROM_Emu_Data ee_current = r_read_eeprom_data();
+	EEPROM_Journal_Header header = 
+	{
+			.magic = JOURNAL_MAGIC,
+			.package_size = size,
+			.package_crc = crc,
+			.check = ~size
+	};
+	
+	// Erases the whole page: the EEPROM data is written back, the old journal is dropped
+	r_write_eeprom_data(&ee_current);
+	
+	HAL_FLASH_Unlock();
+	
+	uint64_t* p_data = (uint64_t*)&header;
+	for (uint32_t i = 0; i < sizeof(EEPROM_Journal_Header)/8; i++) 
+	{
+			HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, OTA_JOURNAL_ADDRESS + i * 8, p_data[i]);
+	}
+	
+	HAL_FLASH_Lock();
+}
+
+//Mark a page of the image as committed
+void 
+r_commit_journal_page(uint32_t page)
+{
+	if(page >= JOURNAL_MAX_PAGES)
+	{
+			return;
+	}
+	
+	uint64_t mark = ((uint64_t)~page << 32) | page;
+	
+	HAL_FLASH_Unlock();
+	HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, OTA_JOURNAL_ADDRESS + sizeof(EEPROM_Journal_Header) + page * 8, mark);
+	HAL_FLASH_Lock();
+	
+	r_flash_data_cache_reset();
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+/**
+ * @file r_fec.h
+ * @brief Reed-Solomon decoder for FEC protected data packets.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 17/10/2026
+ *
+ */
+
+#ifndef R_FEC_H
+#define R_FEC_H
+
+#include "main.h"
+#include "stdint.h"
+
+/**
+ * @brief Correct a FEC protected block in place.
+ *
+ * The block holds the data bytes followed by the parity bytes of its
+ * interleaved codewords (see ETX_OTA_FEC_SIZE()). Each codeword corrects
+ * up to ETX_OTA_FEC_PARITY / 2 wrong bytes.
+ *
+ * @param block     Data bytes followed by their parity bytes.
+ * @param block_len Bytes in the block.
+ * @param data_len  Set to the data bytes in the block.
+ * @param corrected Incremented with the bytes corrected.
+ * @return HAL_OK, or HAL_ERROR if the block is too short or a codeword has too many errors.
+ */
+HAL_StatusTypeDef r_fec_decode(uint8_t *block, uint16_t block_len, uint16_t *data_len, uint32_t *corrected);
+
+/**
+ * @brief Rebuild the lost data packets of a page from its coded packets, in place.
+ *
+ * Every lost fragment holds one coded packet (see ETX_OTA_CODED_) with a
+ * different row; the other fragments hold their data packets. On return
+ * the lost fragments hold their data packets. Only the fragments and a
+ * matrix of ETX_OTA_ERASURE_ROWS^2 bytes on the stack are used.
+ *
+ * @param frags    Fragments of the page, frag_len bytes each.
+ * @param frag_len Bytes per fragment (the data size).
+ * @param count    Fragments in the page.
+ * @param coded    Fragments that hold a coded packet, one bit each.
+ * @param rows     Row of the coded packet held by each fragment.
+ * @return HAL_OK, or HAL_ERROR if more than ETX_OTA_ERASURE_ROWS are lost.
+ */
+HAL_StatusTypeDef r_fec_erasure_decode(uint8_t *frags, uint16_t frag_len, uint8_t count, uint32_t coded, const uint8_t *rows);
+
+#endif // R_FEC_H
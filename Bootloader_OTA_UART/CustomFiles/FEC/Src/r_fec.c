@@ -0,0 +1,462 @@
+/**
+ * @file r_fec.c
+ * @brief Reed-Solomon decoders for FEC protected data packets and erasure coded pages.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 17/10/2026
+ *
+ * @details
+ * Block format (see ETX_OTA_OPT_FEC):
+ * - The data bytes are spread over ceil(block_len / ETX_OTA_FEC_CODEWORD)
+ *   codewords: byte j belongs to codeword j % codewords. A burst of wrong
+ *   bytes is split among all of them.
+ * - Parity byte m of codeword i follows the data at m * codewords + i.
+ * - Each codeword is a systematic RS code over GF(256) (polynomial
+ *   0x11D), generator roots alpha^0 .. alpha^(ETX_OTA_FEC_PARITY - 1),
+ *   with its first data byte as the highest degree coefficient.
+ *
+ * Decoding: syndromes, Berlekamp-Massey for the error locator, Chien
+ * search for the positions and Forney for the values.
+ *
+ * Erasure coded pages (see ETX_OTA_CODED_): coded packet r adds every data
+ * packet k of the page times 1 / ((ETX_OTA_SLOT_MAP_BITS + r) ^ k). Every
+ * square submatrix of this Cauchy matrix is invertible, so any coded
+ * packets rebuild as many lost data packets.
+ */
+
+#include "r_fec.h"
+#include "r_ota_structure.h"
+
+/**
+ * @brief Powers of alpha, twice over so a product needs no modulo.
+ */
+static uint8_t s_gf_exp[510];
+
+/**
+ * @brief Discrete logarithm of every non-zero element.
+ */
+static uint8_t s_gf_log[256];
+
+/**
+ * @brief Set once the tables above are built.
+ */
+static uint8_t s_gf_ready = 0;
+
+// Start Private function prototypes ----------------------------------------------------------------------------------
+/**
+ * @brief Build the GF(256) tables.
+ */
+static void r_gf_init(void);
+
+/**
+ * @brief Multiply two elements of GF(256).
+ */
+static uint8_t r_gf_mul(uint8_t a, uint8_t b);
+
+/**
+ * @brief Divide two elements of GF(256) (b != 0).
+ */
+static uint8_t r_gf_div(uint8_t a, uint8_t b);
+
+/**
+ * @brief Evaluate a polynomial (lowest degree first) at x.
+ */
+static uint8_t r_gf_poly_eval(const uint8_t *poly, uint8_t terms, uint8_t x);
+
+/**
+ * @brief Correct one codeword in place.
+ * @param cw Codeword, highest degree first.
+ * @param n  Bytes in the codeword.
+ * @return Bytes corrected, or -1 if there are too many errors.
+ */
+static int16_t r_fec_correct(uint8_t *cw, uint16_t n);
+
+/**
+ * @brief Coefficient of data packet k in coded packet row.
+ */
+static uint8_t r_erasure_coef(uint8_t row, uint8_t k);
+
+/**
+ * @brief dst += coef * src, byte by byte.
+ */
+static void r_gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coef, uint16_t len);
+
+/**
+ * @brief buf *= coef, byte by byte.
+ */
+static void r_gf_scale(uint8_t *buf, uint8_t coef, uint16_t len);
+// End Private function prototypes ------------------------------------------------------------------------------------
+
+// Start DECODER ------------------------------------------------------------------------------------------------------
+HAL_StatusTypeDef 
+r_fec_decode(uint8_t *block, uint16_t block_len, uint16_t *data_len, uint32_t *corrected)
+{
+    uint16_t codewords = (block_len + ETX_OTA_FEC_CODEWORD - 1U) / ETX_OTA_FEC_CODEWORD;
+    uint16_t parity = codewords * ETX_OTA_FEC_PARITY;
+
+    if (block_len <= parity)
+    {
+        return HAL_ERROR;
+    }
+
+    uint16_t len = block_len - parity;
+    *data_len = len;
+
+    if (!s_gf_ready)
+    {
+        r_gf_init();
+    }
+
+    uint8_t cw[ETX_OTA_FEC_CODEWORD];
+
+    for (uint16_t i = 0; i < codewords; i++)
+    {
+        // Gather codeword i: its data bytes, then its parity bytes
+        uint16_t n = 0;
+        for (uint16_t j = i; j < len; j += codewords)
+        {
+            cw[n++] = block[j];
+        }
+        uint16_t k = n;
+        for (uint16_t m = 0; m < ETX_OTA_FEC_PARITY; m++)
+        {
+            cw[n++] = block[len + (m * codewords) + i];
+        }
+
+        int16_t fixed = r_fec_correct(cw, n);
+        if (fixed < 0)
+        {
+            return HAL_ERROR;
+        }
+
+        if (fixed > 0)
+        {
+            *corrected += (uint32_t)fixed;
+            for (uint16_t j = 0; j < k; j++)
+            {
+                block[i + (j * codewords)] = cw[j];
+            }
+        }
+    }
+
+    return HAL_OK;
+}
+
+static int16_t 
+r_fec_correct(uint8_t *cw, uint16_t n)
+{
+    uint8_t syn[ETX_OTA_FEC_PARITY];
+    uint8_t any = 0;
+
+    // Syndromes: the codeword evaluated at every generator root
+    for (uint8_t r = 0; r < ETX_OTA_FEC_PARITY; r++)
+    {
+        uint8_t root = s_gf_exp[r];
+        uint8_t s = 0;
+        for (uint16_t j = 0; j < n; j++)
+        {
+            s = r_gf_mul(s, root) ^ cw[j];
+        }
+        syn[r] = s;
+        any |= s;
+    }
+
+    if (any == 0)
+    {
+        return 0;
+    }
+
+    // Berlekamp-Massey: error locator lambda (lowest degree first)
+    uint8_t lambda[ETX_OTA_FEC_PARITY + 1] = { 1 };
+    uint8_t prev[ETX_OTA_FEC_PARITY + 1] = { 1 };
+    uint8_t errors = 0;
+    uint8_t shift = 1;
+    uint8_t prev_delta = 1;
+
+    for (uint8_t r = 0; r < ETX_OTA_FEC_PARITY; r++)
+    {
+        uint8_t delta = syn[r];
+        for (uint8_t i = 1; i <= errors; i++)
+        {
+            delta ^= r_gf_mul(lambda[i], syn[r - i]);
+        }
+
+        if (delta == 0)
+        {
+            shift++;
+            continue;
+        }
+
+        uint8_t saved[ETX_OTA_FEC_PARITY + 1];
+        for (uint8_t i = 0; i <= ETX_OTA_FEC_PARITY; i++)
+        {
+            saved[i] = lambda[i];
+        }
+
+        uint8_t scale = r_gf_div(delta, prev_delta);
+        for (uint8_t i = 0; (i + shift) <= ETX_OTA_FEC_PARITY; i++)
+        {
+            lambda[i + shift] ^= r_gf_mul(scale, prev[i]);
+        }
+
+        if ((2U * errors) <= r)
+        {
+            errors = r + 1U - errors;
+            for (uint8_t i = 0; i <= ETX_OTA_FEC_PARITY; i++)
+            {
+                prev[i] = saved[i];
+            }
+            prev_delta = delta;
+            shift = 1;
+        } else
+        {
+            shift++;
+        }
+    }
+
+    if ((2U * errors) > ETX_OTA_FEC_PARITY)
+    {
+        return -1;
+    }
+
+    // Error evaluator omega = syndromes * lambda mod x^parity
+    uint8_t omega[ETX_OTA_FEC_PARITY];
+    for (uint8_t i = 0; i < ETX_OTA_FEC_PARITY; i++)
+    {
+        omega[i] = 0;
+        for (uint8_t j = 0; j <= i; j++)
+        {
+            omega[i] ^= r_gf_mul(syn[i - j], lambda[j]);
+        }
+    }
+
+    // Formal derivative of lambda: only its odd terms remain
+    uint8_t lambda_d[ETX_OTA_FEC_PARITY];
+    for (uint8_t i = 0; i < ETX_OTA_FEC_PARITY; i++)
+    {
+        lambda_d[i] = ((i & 1U) == 0U) ? lambda[i + 1U] : 0U;
+    }
+
+    // Chien search over the positions of this codeword, Forney for each value
+    uint8_t found = 0;
+    for (uint16_t p = 0; p < n; p++)
+    {
+        uint8_t x_inv = s_gf_exp[(255U - p) % 255U];
+        if (r_gf_poly_eval(lambda, errors + 1U, x_inv) != 0)
+        {
+            continue;
+        }
+
+        uint8_t denom = r_gf_poly_eval(lambda_d, ETX_OTA_FEC_PARITY, x_inv);
+        if (denom == 0)
+        {
+            return -1;
+        }
+
+        uint8_t value = r_gf_mul(s_gf_exp[p], r_gf_div(r_gf_poly_eval(omega, ETX_OTA_FEC_PARITY, x_inv), denom));
+        cw[n - 1U - p] ^= value;
+        found++;
+    }
+
+    // Fewer roots than the locator degree: the errors point outside the codeword
+    if (found != errors)
+    {
+        return -1;
+    }
+
+    return found;
+}
+// End DECODER --------------------------------------------------------------------------------------------------------
+
+// Start ERASURE DECODER ----------------------------------------------------------------------------------------------
+HAL_StatusTypeDef 
+r_fec_erasure_decode(uint8_t *frags, uint16_t frag_len, uint8_t count, uint32_t coded, const uint8_t *rows)
+{
+    uint8_t lost[ETX_OTA_ERASURE_ROWS];
+    uint8_t n = 0;
+
+    for (uint8_t k = 0; k < count; k++)
+    {
+        if ((coded & (1UL << k)) != 0U)
+        {
+            if (n >= ETX_OTA_ERASURE_ROWS)
+            {
+                return HAL_ERROR;
+            }
+            lost[n++] = k;
+        }
+    }
+
+    if (!s_gf_ready)
+    {
+        r_gf_init();
+    }
+
+    // Take the data packets received out of every coded packet: the rest only depends on the lost ones
+    uint8_t a[ETX_OTA_ERASURE_ROWS][ETX_OTA_ERASURE_ROWS];
+    for (uint8_t i = 0; i < n; i++)
+    {
+        uint8_t *row_buf = &frags[lost[i] * frag_len];
+        for (uint8_t k = 0; k < count; k++)
+        {
+            if ((coded & (1UL << k)) == 0U)
+            {
+                r_gf_mul_add(row_buf, &frags[k * frag_len], r_erasure_coef(rows[lost[i]], k), frag_len);
+            }
+        }
+        for (uint8_t t = 0; t < n; t++)
+        {
+            a[i][t] = r_erasure_coef(rows[lost[i]], lost[t]);
+        }
+    }
+
+    // Gauss-Jordan on the fragments: coded packet i ends up as lost data packet i, in its own place
+    for (uint8_t t = 0; t < n; t++)
+    {
+        uint8_t p = t;
+        while ((p < n) && (a[p][t] == 0))
+        {
+            p++;
+        }
+        if (p == n)
+        {
+            return HAL_ERROR;
+        }
+
+        if (p != t)
+        {
+            uint8_t *x = &frags[lost[p] * frag_len];
+            uint8_t *y = &frags[lost[t] * frag_len];
+            for (uint16_t j = 0; j < frag_len; j++)
+            {
+                uint8_t tmp = x[j];
+                x[j] = y[j];
+                y[j] = tmp;
+            }
+            for (uint8_t j = 0; j < n; j++)
+            {
+                uint8_t tmp = a[p][j];
+                a[p][j] = a[t][j];
+                a[t][j] = tmp;
+            }
+        }
+
+        uint8_t *pivot_buf = &frags[lost[t] * frag_len];
+        uint8_t scale = r_gf_div(1, a[t][t]);
+        r_gf_scale(pivot_buf, scale, frag_len);
+        for (uint8_t j = 0; j < n; j++)
+        {
+            a[t][j] = r_gf_mul(a[t][j], scale);
+        }
+
+        for (uint8_t i = 0; i < n; i++)
+        {
+            uint8_t f = a[i][t];
+            if ((i == t) || (f == 0))
+            {
+                continue;
+            }
+            r_gf_mul_add(&frags[lost[i] * frag_len], pivot_buf, f, frag_len);
+            for (uint8_t j = 0; j < n; j++)
+            {
+                a[i][j] ^= r_gf_mul(f, a[t][j]);
+            }
+        }
+    }
+
+    return HAL_OK;
+}
+
+static uint8_t 
+r_erasure_coef(uint8_t row, uint8_t k)
+{
+    return r_gf_div(1, (uint8_t)((ETX_OTA_SLOT_MAP_BITS + row) ^ k));
+}
+// End ERASURE DECODER ------------------------------------------------------------------------------------------------
+
+// Start GALOIS FIELD -------------------------------------------------------------------------------------------------
+static void 
+r_gf_init(void)
+{
+    uint16_t x = 1;
+
+    for (uint16_t i = 0; i < 255U; i++)
+    {
+        s_gf_exp[i] = (uint8_t)x;
+        s_gf_exp[i + 255U] = (uint8_t)x;
+        s_gf_log[x] = (uint8_t)i;
+
+        x <<= 1;
+        if (x & 0x100U)
+        {
+            x ^= 0x11DU;
+        }
+    }
+
+    s_gf_ready = 1;
+}
+
+static uint8_t 
+r_gf_mul(uint8_t a, uint8_t b)
+{
+    if ((a == 0) || (b == 0))
+    {
+        return 0;
+    }
+    return s_gf_exp[s_gf_log[a] + s_gf_log[b]];
+}
+
+static uint8_t 
+r_gf_div(uint8_t a, uint8_t b)
+{
+    if (a == 0)
+    {
+        return 0;
+    }
+    return s_gf_exp[(s_gf_log[a] + 255U) - s_gf_log[b]];
+}
+
+static void 
+r_gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coef, uint16_t len)
+{
+    if (coef == 0)
+    {
+        return;
+    }
+
+    uint16_t log_coef = s_gf_log[coef];
+    for (uint16_t i = 0; i < len; i++)
+    {
+        if (src[i] != 0)
+        {
+            dst[i] ^= s_gf_exp[log_coef + s_gf_log[src[i]]];
+        }
+    }
+}
+
+static void 
+r_gf_scale(uint8_t *buf, uint8_t coef, uint16_t len)
+{
+    uint16_t log_coef = s_gf_log[coef];
+
+    for (uint16_t i = 0; i < len; i++)
+    {
+        if (buf[i] != 0)
+        {
+            buf[i] = s_gf_exp[log_coef + s_gf_log[buf[i]]];
+        }
+    }
+}
+
+static uint8_t 
+r_gf_poly_eval(const uint8_t *poly, uint8_t terms, uint8_t x)
+{
+    uint8_t y = 0;
+
+    for (uint8_t i = terms; i > 0; i--)
+    {
+        y = r_gf_mul(y, x) ^ poly[i - 1U];
+    }
+    return y;
+}
+// End GALOIS FIELD ---------------------------------------------------------------------------------------------------
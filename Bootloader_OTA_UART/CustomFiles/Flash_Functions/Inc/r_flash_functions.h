@@ -14,12 +14,37 @@
 #include "string.h"
 #include "stdint.h"
 
+#include "r_ota_config.h"
+#include "r_flash_ram.h"
+
+#if (R_FLASH_PAGE_TIMING != 0)
+/**
+ * @brief Page write times, in CPU cycles (DWT cycle counter).
+ *
+ * Measured from the start of the page (erase included in lazy erase
+ * mode) until its last row or double word is programmed.
+ */
+typedef struct
+{
+    uint32_t last;      /**< Last page. */
+    uint32_t min;       /**< Fastest page. */
+    uint32_t max;       /**< Slowest page. */
+    uint32_t total;     /**< Sum of every page. */
+    uint32_t pages;     /**< Pages measured. */
+} R_FLASH_TIMING_;
+
+/**
+ * @brief Page write times since the last reset.
+ */
+extern volatile R_FLASH_TIMING_ g_flash_page_timing;
+#endif
+
 /**
  * @brief Program a flash page with provided data.
  *
  * This function writes an entire flash page at the specified address.
- * Data is programmed in 64-bit (double word) chunks, as required by 
- * the STM32 flash programming interface.
+ * Data is programmed in fast programming rows, or in 64-bit (double
+ * word) chunks (see R_FLASH_PROGRAM_MODE).
  *
  * @param address  Starting address of the flash page to program.
  * @param data     Pointer to the buffer containing data to be written.
@@ -47,6 +72,14 @@ void r_flash_erase_page(uint32_t address);
 void r_flash_swap_pages(uint32_t addrA, uint32_t addrB);
 
 
+/**
+ * @brief Drop the flash data cache lines.
+ *
+ * Must be called after programming flash that may already be cached,
+ * so the new contents are read back instead of the erased ones.
+ */
+void r_flash_data_cache_reset(void);
+
 /**
  * @brief Swap contents of two flash banks.
  *
@@ -61,4 +94,43 @@ void r_flash_swap_pages(uint32_t addrA, uint32_t addrB);
  */
 void r_flash_swap_bank(uint32_t baseA, uint32_t baseB, uint32_t num_pages);
 
+/**
+ * @brief Start writing a flash page in the background.
+ *
+ * The page is optionally erased, then programmed one fast row per call
+ * to r_flash_write_process(), or one double word per flash interrupt.
+ * r_flash_write_process() must be called from the main loop to start
+ * each operation, and @p data must stay untouched until
+ * r_flash_write_busy() returns 0.
+ *
+ * @param address  Starting address of the flash page to program.
+ * @param data     Pointer to the FLASH_PAGE_SIZE bytes to be written.
+ * @param erase    1 to erase the page before programming it.
+ * @return HAL_OK if the write started, HAL_BUSY if a page is still being written, HAL_ERROR otherwise.
+ */
+HAL_StatusTypeDef r_flash_write_page_start(uint32_t address, const uint8_t *data, uint8_t erase);
+
+/**
+ * @brief Start the next operation of the background page write.
+ *
+ * Returns immediately while the previous operation is still running.
+ */
+void r_flash_write_process(void);
+
+/**
+ * @brief Check whether a background page write is running.
+ * @return 1 while the page is being written, 0 once it is finished.
+ */
+uint8_t r_flash_write_busy(void);
+
+/**
+ * @brief Result of the last background page write.
+ * @return HAL_OK if every operation succeeded, HAL_ERROR otherwise.
+ */
+HAL_StatusTypeDef r_flash_write_result(void);
+
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue);
+
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue);
+
 #endif // R_FLASH_FUNCTIONS_H
\ No newline at end of file
@@ -0,0 +1,32 @@
+/**
+ * @file r_flash_ram.h
+ * @brief Flash routines executed from RAM.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 17/10/2026
+ *
+ */
+
+#ifndef R_FLASH_RAM_H
+#define R_FLASH_RAM_H
+
+#include "main.h"
+#include "stdint.h"
+
+/** Bytes written by one fast programming row (32 double words). */
+#define R_FLASH_ROW_SIZE						256U
+
+/**
+ * @brief Fast program one row of an erased flash page.
+ *
+ * The 32 double words are written back to back with interrupts masked,
+ * as the fast programming mode requires. The flash must be unlocked and
+ * @p data must be in RAM.
+ *
+ * @param address  Row-aligned flash address.
+ * @param data     R_FLASH_ROW_SIZE bytes to be written.
+ * @return HAL_OK on success, HAL_ERROR if the flash reported an error.
+ */
+HAL_StatusTypeDef r_flash_program_row_fast(uint32_t address, const uint32_t *data);
+
+#endif // R_FLASH_RAM_H
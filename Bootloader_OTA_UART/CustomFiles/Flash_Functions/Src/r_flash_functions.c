@@ -15,6 +15,10 @@
  * - Page erasing (`r_flash_erase_page`)
  * - Page swapping (`r_flash_swap_pages`)
  * - Bank swapping (`r_flash_swap_bank`)
+ * - Background page writing driven by the flash interrupt (`r_flash_write_page_start`)
+ *
+ * Pages are written with fast programming rows when R_FLASH_PROGRAM_MODE
+ * selects it (see r_flash_ram.c), falling back to double words.
  *
  * These utilities use the STM32 HAL API for flash operations and follow
  * STM32 constraints, such as programming in double words (64-bit).
@@ -22,17 +26,140 @@
 
 #include "r_flash_functions.h"
 
+// Start STATIC Variables ---------------------------------------------------------------------------------------------
+/**
+ * @brief Page being written in the background.
+ */
+static const uint8_t *s_write_data = NULL;
+
+/**
+ * @brief Flash address of the page being written in the background.
+ */
+static uint32_t s_write_address = 0;
+
+/**
+ * @brief Bytes of the page already programmed.
+ */
+static volatile uint32_t s_write_offset = 0;
+
+/**
+ * @brief Set while the page still has to be erased.
+ */
+static uint8_t s_write_erase = 0;
+
+/**
+ * @brief Set while a background page write is running.
+ */
+static volatile uint8_t s_write_busy = 0;
+
+/**
+ * @brief Set while an erase or program operation waits for its flash interrupt.
+ */
+static volatile uint8_t s_write_op_pending = 0;
+
+/**
+ * @brief Result of the background page write.
+ */
+static volatile HAL_StatusTypeDef s_write_status = HAL_OK;
+
+#if (R_FLASH_PROGRAM_MODE == R_FLASH_PROGRAM_FAST)
+/**
+ * @brief RAM copy of the row being fast programmed (the source may be in flash or unaligned).
+ */
+static uint32_t s_row_buffer[R_FLASH_ROW_SIZE / 4U];
+
+/**
+ * @brief Set once a fast row failed: double words are used until the next reset.
+ */
+static uint8_t s_fast_disabled = 0;
+#endif
+
+#if (R_FLASH_PAGE_TIMING != 0)
+volatile R_FLASH_TIMING_ g_flash_page_timing = {0};
+
+/**
+ * @brief Cycle counter value when the page being timed started.
+ */
+static uint32_t s_timing_start = 0;
+#endif
+// End STATIC Variables -----------------------------------------------------------------------------------------------
+
+// Start Private function prototypes ----------------------------------------------------------------------------------
+#if (R_FLASH_PROGRAM_MODE == R_FLASH_PROGRAM_FAST)
+/**
+ * @brief Fast program one row through @ref s_row_buffer.
+ *
+ * Disables fast programming on error.
+ *
+ * @param address  Row-aligned flash address.
+ * @param data     R_FLASH_ROW_SIZE bytes to be written.
+ * @return HAL_OK on success, HAL_ERROR otherwise.
+ */
+static HAL_StatusTypeDef r_flash_program_row(uint32_t address, const uint8_t *data);
+#endif
+
+#if (R_FLASH_SKIP_ERASED != 0)
+/**
+ * @brief Check whether data already reads as erased flash.
+ *
+ * @param data     Data to be written.
+ * @param length   Number of bytes, a multiple of 4.
+ * @return 1 if every byte is 0xFF.
+ */
+static uint8_t r_flash_is_erased(const uint8_t *data, uint32_t length);
+#endif
+
+#if (R_FLASH_PAGE_TIMING != 0)
+/**
+ * @brief Start timing a page write.
+ */
+static void r_flash_timing_start(void);
+
+/**
+ * @brief Stop timing a page write and update g_flash_page_timing.
+ */
+static void r_flash_timing_stop(void);
+#endif
+// End Private function prototypes ------------------------------------------------------------------------------------
+
 // Start PAGE FUNCTIONALITY -------------------------------------------------------------------------------------------
 
 void 
 r_flash_program_page(uint32_t address, uint8_t* data) 
 {
-    for (uint32_t i = 0; i < FLASH_PAGE_SIZE; i += 8) 
+#if (R_FLASH_PAGE_TIMING != 0)
+    r_flash_timing_start();
+#endif
+
+#if (R_FLASH_PROGRAM_MODE == R_FLASH_PROGRAM_FAST)
+    uint32_t offset = 0;
+
+    while (!s_fast_disabled && (offset < FLASH_PAGE_SIZE))
 		{
-        uint64_t data64 = 0;
-        memcpy(&data64, data + i, sizeof(uint64_t));
-        HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address + i, data64);
+        if (r_flash_program_row(address + offset, data + offset) == HAL_OK)
+				{
+            offset += R_FLASH_ROW_SIZE;
+        } else
+				{
+						// Fallback: erase again and program the whole page in double words
+            r_flash_erase_page(address);
+        }
     }
+
+    if (offset < FLASH_PAGE_SIZE)
+#endif
+    {
+        for (uint32_t i = 0; i < FLASH_PAGE_SIZE; i += 8) 
+				{
+            uint64_t data64 = 0;
+            memcpy(&data64, data + i, sizeof(uint64_t));
+            HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address + i, data64);
+        }
+    }
+
+#if (R_FLASH_PAGE_TIMING != 0)
+    r_flash_timing_stop();
+#endif
 }
 
 void 
@@ -62,6 +189,18 @@ r_flash_swap_pages(uint32_t addrA, uint32_t addrB)
     HAL_FLASH_Lock();
 }
 
+void 
+r_flash_data_cache_reset(void)
+{
+		// Only HAL_FLASHEx_Erase() flushes the caches, programming leaves stale lines behind
+    if (READ_BIT(FLASH->ACR, FLASH_ACR_DCEN) != 0U)
+		{
+        __HAL_FLASH_DATA_CACHE_DISABLE();
+        __HAL_FLASH_DATA_CACHE_RESET();
+        __HAL_FLASH_DATA_CACHE_ENABLE();
+    }
+}
+
 // End PAGE FUNCTIONALITY ---------------------------------------------------------------------------------------------
 
 // Start BANK FUNCTIONALITY -------------------------------------------------------------------------------------------
@@ -85,4 +224,231 @@ r_flash_swap_bank(uint32_t baseA, uint32_t baseB, uint32_t num_pages)
     }
 }
 
-// End BANK FUNCTIONALITY ---------------------------------------------------------------------------------------------
\ No newline at end of file
+// End BANK FUNCTIONALITY ---------------------------------------------------------------------------------------------
+
+// Start BACKGROUND PAGE WRITE ----------------------------------------------------------------------------------------
+
+HAL_StatusTypeDef 
+r_flash_write_page_start(uint32_t address, const uint8_t *data, uint8_t erase)
+{
+    if (s_write_busy)
+		{
+        return HAL_BUSY;
+    }
+
+    s_write_data = data;
+    s_write_address = address;
+    s_write_offset = 0;
+    s_write_erase = erase;
+    s_write_op_pending = 0;
+    s_write_status = HAL_OK;
+    s_write_busy = 1;
+
+#if (R_FLASH_PAGE_TIMING != 0)
+    r_flash_timing_start();
+#endif
+
+    HAL_FLASH_Unlock();
+    r_flash_write_process();
+
+    return s_write_status;
+}
+
+void 
+r_flash_write_process(void)
+{
+    if (!s_write_busy || s_write_op_pending)
+		{
+        return;
+    }
+
+    if ((s_write_status == HAL_OK) && (s_write_offset < FLASH_PAGE_SIZE))
+		{
+        HAL_StatusTypeDef status;
+
+#if (R_FLASH_PROGRAM_MODE == R_FLASH_PROGRAM_FAST)
+        if (!s_write_erase && !s_fast_disabled)
+				{
+#if (R_FLASH_SKIP_ERASED != 0)
+						// The page is erased: a row of 0xFF needs no programming
+            if (r_flash_is_erased(s_write_data + s_write_offset, R_FLASH_ROW_SIZE))
+						{
+                s_write_offset += R_FLASH_ROW_SIZE;
+                return;
+            }
+#endif
+						// One row per call, with interrupts masked for its duration
+            if (r_flash_program_row(s_write_address + s_write_offset, s_write_data + s_write_offset) == HAL_OK)
+						{
+                s_write_offset += R_FLASH_ROW_SIZE;
+            } else
+						{
+								// Fallback: erase again and program the whole page in double words
+                s_write_offset = 0;
+                s_write_erase = 1;
+            }
+            return;
+        }
+#endif
+
+#if (R_FLASH_SKIP_ERASED != 0)
+        if (!s_write_erase && r_flash_is_erased(s_write_data + s_write_offset, sizeof(uint64_t)))
+				{
+            s_write_offset += sizeof(uint64_t);
+            return;
+        }
+#endif
+
+				// Cleared by the flash interrupt, which cannot start the next operation itself (HAL still locked)
+        s_write_op_pending = 1;
+
+        if (s_write_erase)
+				{
+            FLASH_EraseInitTypeDef erase;
+
+            erase.TypeErase = FLASH_TYPEERASE_PAGES;
+            erase.Page = (s_write_address - FLASH_BASE) / FLASH_PAGE_SIZE;
+            erase.NbPages = 1;
+
+            s_write_erase = 0;
+            status = HAL_FLASHEx_Erase_IT(&erase);
+        } else
+				{
+            uint64_t data64 = 0;
+            memcpy(&data64, s_write_data + s_write_offset, sizeof(uint64_t));
+            status = HAL_FLASH_Program_IT(FLASH_TYPEPROGRAM_DOUBLEWORD, s_write_address + s_write_offset, data64);
+        }
+
+        if (status == HAL_OK)
+				{
+            return;
+        }
+
+        s_write_op_pending = 0;
+        s_write_status = HAL_ERROR;
+    }
+
+		// Page finished (or failed): the page must read back as programmed
+    r_flash_data_cache_reset();
+
+    HAL_FLASH_Lock();
+    s_write_busy = 0;
+
+#if (R_FLASH_PAGE_TIMING != 0)
+    r_flash_timing_stop();
+#endif
+}
+
+uint8_t 
+r_flash_write_busy(void)
+{
+    return s_write_busy;
+}
+
+HAL_StatusTypeDef 
+r_flash_write_result(void)
+{
+    return s_write_status;
+}
+
+void 
+HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+    if (!s_write_op_pending)
+		{
+        return;
+    }
+
+		// The erase reports its page number, a program the address of its double word
+    if (ReturnValue == (s_write_address + s_write_offset))
+		{
+        s_write_offset += sizeof(uint64_t);
+    }
+
+    s_write_op_pending = 0;
+}
+
+void 
+HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+    (void)ReturnValue;
+
+    s_write_status = HAL_ERROR;
+    s_write_op_pending = 0;
+}
+
+// End BACKGROUND PAGE WRITE ------------------------------------------------------------------------------------------
+
+// Start PRIVATE FUNCTIONS --------------------------------------------------------------------------------------------
+
+#if (R_FLASH_PROGRAM_MODE == R_FLASH_PROGRAM_FAST)
+static HAL_StatusTypeDef 
+r_flash_program_row(uint32_t address, const uint8_t *data)
+{
+		// The fast row must not read the flash, so the source is always copied to RAM first
+    memcpy(s_row_buffer, data, R_FLASH_ROW_SIZE);
+
+    if (r_flash_program_row_fast(address, s_row_buffer) != HAL_OK)
+		{
+        s_fast_disabled = 1;
+        return HAL_ERROR;
+    }
+
+    return HAL_OK;
+}
+#endif
+
+#if (R_FLASH_SKIP_ERASED != 0)
+static uint8_t 
+r_flash_is_erased(const uint8_t *data, uint32_t length)
+{
+    uint32_t word;
+
+    for (uint32_t i = 0; i < length; i += sizeof(uint32_t))
+		{
+        memcpy(&word, data + i, sizeof(uint32_t));
+        if (word != 0xFFFFFFFFUL)
+				{
+            return 0;
+        }
+    }
+
+    return 1;
+}
+#endif
+
+#if (R_FLASH_PAGE_TIMING != 0)
+static void 
+r_flash_timing_start(void)
+{
+    if ((DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk) == 0U)
+		{
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+
+    s_timing_start = DWT->CYCCNT;
+}
+
+static void 
+r_flash_timing_stop(void)
+{
+    uint32_t cycles = DWT->CYCCNT - s_timing_start;
+
+    g_flash_page_timing.last = cycles;
+    g_flash_page_timing.total += cycles;
+    g_flash_page_timing.pages++;
+
+    if ((g_flash_page_timing.min == 0U) || (cycles < g_flash_page_timing.min))
+		{
+        g_flash_page_timing.min = cycles;
+    }
+    if (cycles > g_flash_page_timing.max)
+		{
+        g_flash_page_timing.max = cycles;
+    }
+}
+#endif
+
+// End PRIVATE FUNCTIONS ----------------------------------------------------------------------------------------------
\ No newline at end of file
@@ -0,0 +1,62 @@
+/**
+ * @file r_flash_ram.c
+ * @brief Flash routines executed from RAM.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 17/10/2026
+ *
+ * @details
+ * In fast programming mode the 32 double words of a row must reach the
+ * flash interface without gaps: a code fetch from flash in the middle of
+ * the row ends it with a MISSERR. The whole module is therefore placed in
+ * RAM by the project (Options for File 'r_flash_ram.c' > Code/Const:
+ * IRAM1, see stm32wle5xx_flash.sct) and only uses registers and inline
+ * CMSIS functions, never the HAL functions that live in flash.
+ */
+
+#include "r_flash_ram.h"
+
+// Start FAST PROGRAMMING ---------------------------------------------------------------------------------------------
+
+HAL_StatusTypeDef 
+r_flash_program_row_fast(uint32_t address, const uint32_t *data)
+{
+    __IO uint32_t *dest = (__IO uint32_t *)address;
+    uint32_t primask_bit;
+    uint32_t error;
+
+		// No operation on going and no error left from a previous one
+    while ((FLASH->SR & (FLASH_SR_BSY | FLASH_SR_CFGBSY)) != 0U)
+		{
+    }
+    WRITE_REG(FLASH->SR, FLASH_FLAG_SR_ERRORS | FLASH_FLAG_EOP);
+
+    SET_BIT(FLASH->CR, FLASH_CR_FSTPG);
+
+		// Critical section: the row must not be interrupted (and must last less than 7 ms)
+    primask_bit = __get_PRIMASK();
+    __disable_irq();
+
+    for (uint32_t i = 0; i < (R_FLASH_ROW_SIZE / 4U); i++)
+		{
+        dest[i] = data[i];
+    }
+
+    while ((FLASH->SR & FLASH_SR_BSY) != 0U)
+		{
+    }
+
+    __set_PRIMASK(primask_bit);
+
+    error = FLASH->SR & FLASH_FLAG_SR_ERRORS;
+
+    while ((FLASH->SR & FLASH_SR_CFGBSY) != 0U)
+		{
+    }
+    CLEAR_BIT(FLASH->CR, FLASH_CR_FSTPG);
+    WRITE_REG(FLASH->SR, error | FLASH_FLAG_EOP);
+
+    return (error == 0U) ? HAL_OK : HAL_ERROR;
+}
+
+// End FAST PROGRAMMING -----------------------------------------------------------------------------------------------
@@ -15,15 +15,39 @@
 //#include "usart.h"
 
 #include "r_crc.h"
+#include "r_ota_config.h"
 #include "r_ota_structure.h"
 #include "r_eeprom_structure.h"
+#include "r_flash_functions.h"
+#include "r_lzss.h"
+#include "r_delta.h"
+#include "r_fec.h"
 
 #include "r_flash_addresses.h"
 
+/**
+ * @brief Largest Len of a packet with R_OTA_PAYLOAD_MAX data bytes (coded packets add their Row).
+ */
+#if (R_OTA_ERASURE != 0)
+#define R_OTA_DATA_LEN_MAX				( R_OTA_PAYLOAD_MAX + ETX_OTA_CODED_ROW_SIZE )
+#else
+#define R_OTA_DATA_LEN_MAX				( R_OTA_PAYLOAD_MAX )
+#endif
+
+/**
+ * @brief Size of the packet buffers, enough for a packet of R_OTA_DATA_LEN_MAX data bytes
+ * (and their FEC parity).
+ */
+#if (R_OTA_FEC != 0)
+#define R_OTA_PACKET_BUFFER_SIZE	( R_OTA_DATA_LEN_MAX + ETX_OTA_FEC_SIZE(R_OTA_DATA_LEN_MAX) + ETX_OTA_DATA_OVERHEAD )
+#else
+#define R_OTA_PACKET_BUFFER_SIZE	( R_OTA_DATA_LEN_MAX + ETX_OTA_DATA_OVERHEAD )
+#endif
+
 /**
  * @brief Raw receive buffer for incoming OTA packets.
  */
-extern volatile uint8_t g_rx_buffer[ETX_OTA_PACKET_MAX_SIZE];
+extern volatile uint8_t g_rx_buffer[R_OTA_PACKET_BUFFER_SIZE];
 
 /**
  * @brief Total firmware size (in bytes) expected during OTA.
@@ -52,4 +76,29 @@ extern volatile ETX_OTA_STATE_ g_ota_state;
  */
 void r_receive_update();
 
+/**
+ * @brief Answer ETX_OTA_RESP_ACK to the host, as after the start command.
+ *
+ * Also sent at boot when the App left an update pending, so the host
+ * knows the bootloader is listening.
+ */
+void r_send_ack(void);
+
+/**
+ * @brief Advance the background write of the last completed page.
+ *
+ * Runs in the main loop, next to r_uart_process_rx(), so pages are
+ * programmed while the following packets are being received. Adds each
+ * finished page to the running image CRC.
+ */
+void r_flash_pipeline_process(void);
+
+/**
+ * @brief Go back to the previous baud rate if ETX_OTA_CMD_SET_BAUD was not confirmed in time.
+ *
+ * Runs in the main loop: after a switch the host may never reach the new
+ * rate, and then nothing else arrives to notice it.
+ */
+void r_baud_process(void);
+
 #endif // R_TASK_UPDATE_H
\ No newline at end of file
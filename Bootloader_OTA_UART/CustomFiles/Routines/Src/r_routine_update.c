@@ -25,12 +25,17 @@
  */
 
 #include "r_routine_update.h"
+#include "r_uart_callback.h"
+
+#if ((R_OTA_PAYLOAD_MAX & (R_OTA_PAYLOAD_MAX - 1U)) != 0) || (R_OTA_PAYLOAD_MAX > FLASH_PAGE_SIZE) || (R_OTA_PAYLOAD_MAX < ETX_OTA_DATA_MAX_SIZE)
+#error "R_OTA_PAYLOAD_MAX must be a power of two between ETX_OTA_DATA_MAX_SIZE and FLASH_PAGE_SIZE"
+#endif
 
 // Start VOLATILE Variables -------------------------------------------------------------------------------------------
 /**
  * @brief Raw receive buffer for incoming OTA packets.
  */
-volatile uint8_t g_rx_buffer[ETX_OTA_PACKET_MAX_SIZE] = {0};
+volatile uint8_t g_rx_buffer[R_OTA_PACKET_BUFFER_SIZE] = {0};
 
 /**
  * @brief Total firmware size (in bytes) expected during OTA.
@@ -87,13 +92,13 @@ static uint16_t s_page_offset = 0;
 static uint32_t s_pagecrc = 0;
 
 /**
- * @brief Accumulated CRC32 of the entire firmware written to flash.
+ * @brief Running CRC32 of the firmware programmed into flash.
  *
- * This variable stores the CRC32 value calculated over all the
- * firmware data programmed into flash (Bank B). It is used to
- * validate the firmware integrity after the OTA update.
+ * Fed with every page right after it is programmed (read back from flash
+ * with R_OTA_CRC_READBACK), so the end command only compares it with the
+ * CRC announced in the header instead of reading the whole image again.
  */
-static uint32_t s_flash_crc = 0;
+static R_CRC_CTX_ s_image_crc;
 
 /**
  * @brief Current write index in Bank B flash memory.
@@ -101,9 +106,220 @@ static uint32_t s_flash_crc = 0;
 static uint32_t s_bank_a_index = APP_A_ADDRESS;
 
 /**
- * @brief Temporary buffer for one flash page of firmware data.
+ * @brief Ping-pong page buffers: one is filled from the UART while the other is programmed.
+ */
+static uint8_t s_page_buffers[2][FLASH_PAGE_SIZE] = {0};
+
+/**
+ * @brief Page buffer being filled with firmware data.
+ */
+static uint8_t *s_page_buffer = s_page_buffers[0];
+
+/**
+ * @brief Set while a page handed to the background writer is not finished.
+ */
+static uint8_t s_flight_busy = 0;
+
+/**
+ * @brief Flash address of the page being written in the background.
+ */
+static uint32_t s_flight_address = 0;
+
+/**
+ * @brief Firmware bytes in the page being written (less than FLASH_PAGE_SIZE on the last one).
+ */
+static uint16_t s_flight_length = 0;
+
+/**
+ * @brief Page buffer being written in the background.
+ */
+static uint8_t *s_flight_data = NULL;
+
+/**
+ * @brief Data bytes per packet negotiated with the header packet (meta_info.reserved1).
+ *
+ * A power of two, so the data packets never straddle two flash pages.
+ */
+static uint16_t s_payload_size = ETX_OTA_DATA_MAX_SIZE;
+
+/**
+ * @brief Data packets the host may keep in flight, 0 for stop-and-wait.
+ *
+ * Negotiated with the header packet (meta_info.reserved2).
+ */
+static uint8_t s_window_size = 0;
+
+/**
+ * @brief Sequence number of the next data packet expected in window mode.
+ */
+static uint16_t s_next_seq = 0;
+
+/**
+ * @brief Sequence number of the first data packet of the page being assembled.
+ */
+static uint16_t s_page_first_seq = 0;
+
+/**
+ * @brief Set once a NACK was sent for the current gap, so it is not repeated
+ * for every packet the host already had in flight.
+ */
+static uint8_t s_nack_sent = 0;
+
+/**
+ * @brief Error code of the NACK answered when the packet being processed is rejected.
+ */
+static ETX_OTA_RESP_ERR_ s_nack_error = ETX_OTA_ERR_PACKET;
+
+#if (R_OTA_SET_BAUD != 0)
+/**
+ * @brief Baud rate switched to by ETX_OTA_CMD_SET_BAUD and not confirmed yet, 0 if none.
+ */
+static uint32_t s_baud_pending = 0;
+
+/**
+ * @brief Baud rate before the switch, restored if it is not confirmed.
+ */
+static uint32_t s_baud_previous = 0;
+
+/**
+ * @brief HAL tick of the switch, for R_OTA_BAUD_CONFIRM_MS.
+ */
+static uint32_t s_baud_tick = 0;
+#endif
+
+/**
+ * @brief Set when the next page needs its bulk header before any data packet.
+ */
+static uint8_t s_bulk_pending = 1;
+
+/**
+ * @brief First application page erased by the header packet.
+ *
+ * Pages below it were kept for a resume, and are erased again before
+ * being programmed if the host starts over instead.
+ */
+static uint32_t s_erase_start = APP_A_ADDRESS;
+
+#if (R_OTA_RESUME != 0)
+/**
+ * @brief Pages of the announced image already committed to the update journal.
+ */
+static uint32_t s_resume_pages = 0;
+
+/**
+ * @brief Set once the update journal belongs to the current update.
+ */
+static uint8_t s_journal_open = 0;
+#endif
+
+#if (R_OTA_PAGE_DIFF != 0)
+/**
+ * @brief Set when the header requested a page-diff update (ETX_OTA_OPT_PAGE_DIFF).
+ */
+static uint8_t s_page_diff = 0;
+#endif
+
+#if (R_OTA_LZSS != 0)
+/**
+ * @brief Set when the header allowed compressed pages (ETX_OTA_OPT_LZSS).
  */
-static uint8_t s_page_buffer[FLASH_PAGE_SIZE] = {0};
+static uint8_t s_lzss_granted = 0;
+
+/**
+ * @brief Decoder state of the compressed page being assembled.
+ */
+static R_LZSS_CTX_ s_lzss;
+#endif
+
+#if (R_OTA_DELTA != 0)
+/**
+ * @brief Set when the header allowed pages sent as a delta (ETX_OTA_OPT_DELTA, with page-diff).
+ */
+static uint8_t s_delta_granted = 0;
+
+/**
+ * @brief Decoder state of the delta page being assembled.
+ */
+static R_DELTA_CTX_ s_delta;
+#endif
+
+#if (R_OTA_FILL != 0)
+/**
+ * @brief Set when the header allowed fill packets (ETX_OTA_OPT_FILL).
+ */
+static uint8_t s_fill_granted = 0;
+#endif
+
+#if (R_OTA_SELECTIVE != 0)
+/**
+ * @brief Set when the header allowed selective retransmission (ETX_OTA_OPT_SELECTIVE).
+ */
+static uint8_t s_selective_granted = 0;
+
+/**
+ * @brief Slots of the page being assembled already placed, one bit per data packet.
+ */
+static uint32_t s_slot_map = 0;
+
+/**
+ * @brief Slots already asked for with NACK_MAP and not received yet.
+ */
+static uint32_t s_slot_asked = 0;
+
+/**
+ * @brief Slots asked for by the last NACK_MAP and not received yet.
+ */
+static uint32_t s_slot_last_asked = 0;
+
+/**
+ * @brief Highest sequence number received when the last NACK_MAP was sent.
+ */
+static uint16_t s_slot_asked_seq = 0;
+
+/**
+ * @brief Set when packets of the next page were dropped because the current one was not complete.
+ */
+static uint8_t s_slot_overrun = 0;
+
+/**
+ * @brief Slots of the page being assembled already acknowledged.
+ */
+static uint32_t s_slot_acked = 0;
+#endif
+
+#if (R_OTA_ERASURE != 0)
+/**
+ * @brief Coded packets the host sends after each page (ETX_OTA_OPT_CODED_MASK), 0 without erasure coding.
+ */
+static uint8_t s_coded_count = 0;
+
+/**
+ * @brief Missing slots of the page being assembled that hold a coded packet instead, one bit each.
+ */
+static uint32_t s_coded_map = 0;
+
+/**
+ * @brief Row of the coded packet held by each slot of s_coded_map.
+ */
+static uint8_t s_coded_rows[ETX_OTA_SLOT_MAP_BITS] = {0};
+
+/**
+ * @brief Data packets rebuilt from coded packets since reset, readable from the debugger.
+ */
+static uint32_t s_erasure_rebuilt = 0;
+#endif
+
+#if (R_OTA_FEC != 0)
+/**
+ * @brief Set when the header allowed FEC protected data packets (ETX_OTA_OPT_FEC).
+ */
+static uint8_t s_fec_granted = 0;
+
+/**
+ * @brief Bytes corrected by the FEC parity since reset, readable from the debugger.
+ */
+static uint32_t s_fec_corrected = 0;
+#endif
 
 extern UART_HandleTypeDef *p_uart;
 
@@ -113,19 +329,32 @@ extern volatile uint8_t s_packet_ready;
 
 
 // Start Private function prototypes ----------------------------------------------------------------------------------
+#if (R_OTA_ERASE_MODE != R_OTA_ERASE_PAGE)
 /**
- * @brief Erase all pages corresponding to Bank B firmware region.
+ * @brief Erase flash pages of the application region.
+ * @param address  Address of the first page.
+ * @param nb_pages Number of pages to erase.
  * @return HAL status.
  */
-static HAL_StatusTypeDef r_clean_bank (void);
+static HAL_StatusTypeDef r_erase_pages(uint32_t address, uint32_t nb_pages);
+#endif
 
 /**
- * @brief Program a full flash page with data from a buffer.
+ * @brief Hand the page buffer being filled to the background writer.
+ *
+ * Waits only while the previous page is still being written, then
+ * switches the page assembly to the other buffer.
+ *
  * @param address Starting flash address to write.
- * @param data    Pointer to the page data (must be FLASH_PAGE_SIZE bytes).
+ * @param length  Firmware bytes in the page (the rest is 0xFF padding).
  * @return HAL status.
  */
-static HAL_StatusTypeDef r_flash_program_page(uint32_t address, uint8_t* data);
+static HAL_StatusTypeDef r_flash_queue_page(uint32_t address, uint16_t length);
+
+/**
+ * @brief Block until the page being written in the background is finished.
+ */
+static void r_flash_pipeline_wait(void);
 
 /**
  * @brief Process a received firmware packet.
@@ -142,17 +371,274 @@ static HAL_StatusTypeDef r_flash_program_page(uint32_t address, uint8_t* data);
  */
 static HAL_StatusTypeDef r_flash_process_data(uint8_t *data, uint16_t data_len);
 
+#if (R_OTA_LZSS != 0) || (R_OTA_DELTA != 0)
+/**
+ * @brief Decode a compressed or delta packet into the page buffer.
+ *
+ * A page that fails to decode, or whose stream goes past the end of the
+ * page, is dropped like a page with a CRC mismatch.
+ *
+ * @param packet_type ETX_OTA_PACKET_TYPE_DATA_LZ or ETX_OTA_PACKET_TYPE_DATA_DELTA.
+ * @param data        Pointer to packet payload.
+ * @param data_len    Number of bytes in the packet payload.
+ * @return HAL status.
+ */
+static HAL_StatusTypeDef r_flash_decode_data(uint8_t packet_type, uint8_t *data, uint16_t data_len);
+#endif
+
+#if (R_OTA_FILL != 0)
+/**
+ * @brief Check a fill packet against the page being assembled.
+ *
+ * It must continue the page at its current offset, and end within the
+ * page and the image.
+ *
+ * @param fill Fill packet.
+ * @return 1 if it can be applied.
+ */
+static uint8_t r_fill_valid(const ETX_OTA_FILL_ *fill);
+
+/**
+ * @brief Place a run of a constant byte in the page buffer.
+ * @param fill Fill packet, already checked by r_fill_valid().
+ * @return HAL status.
+ */
+static HAL_StatusTypeDef r_flash_fill_data(const ETX_OTA_FILL_ *fill);
+#endif
+
+/**
+ * @brief Account for bytes just placed in the page buffer.
+ *
+ * When the page is full, or the image is complete, the page CRC is
+ * checked against the bulk header and the page is handed to the writer.
+ *
+ * @param length Bytes added at s_page_offset.
+ * @return HAL status.
+ */
+static HAL_StatusTypeDef r_flash_page_advance(uint16_t length);
+
 /**
  * @brief Write the last incomplete page to flash.
  * @return HAL status.
  */
 static HAL_StatusTypeDef r_flash_program_last_data();
 
+/**
+ * @brief Add the page just written in the background to the running image CRC.
+ */
+static void r_image_crc_add_page(void);
+
 /**
  * @brief Process an OTA packet depending on the OTA state machine.
  * @return ETX_OTA_EX_OK on success, ETX_OTA_EX_ERR on failure.
  */
 static ETX_OTA_EX_ r_process_pack(void);
+
+/**
+ * @brief Process a bulk header or data packet in window mode.
+ *
+ * Data packets are taken strictly in sequence order (raw and fill packets
+ * by their slot with selective retransmission). Every accepted packet
+ * is acknowledged with ETX_OTA_RESP_ACK and its Seq (cumulative), and a
+ * gap or a page whose CRC does not match is answered once with
+ * ETX_OTA_RESP_NACK, whose Seq is the packet the host must resend from.
+ *
+ * @return ETX_OTA_EX_OK if the packet was handled, ETX_OTA_EX_ERR on an unexpected packet type.
+ */
+static ETX_OTA_EX_ r_process_window_pack(void);
+
+/**
+ * @brief Drop the page just closed with a CRC mismatch (or a broken stream)
+ * and ask for it again from its bulk header.
+ */
+static void r_window_page_retry(void);
+
+/**
+ * @brief Why the page just completed was not queued for programming.
+ * @return ETX_OTA_ERR_PAGE_CRC, or ETX_OTA_ERR_FLASH if its CRC matched.
+ */
+static ETX_OTA_RESP_ERR_ r_page_error(void);
+
+/**
+ * @brief Move the window to the next page once the current one is closed,
+ * and end the update after the last one.
+ */
+static void r_window_page_next(void);
+
+#if (R_OTA_SELECTIVE != 0)
+/**
+ * @brief Place a raw or fill packet at its slot of the page being assembled.
+ *
+ * Slot n of the page holds the data at n * data size, and its packet
+ * carries the page first sequence number + n (a fill packet may cover
+ * several slots). Packets after a gap are kept, and the missing slots
+ * are asked for with ETX_OTA_RESP_NACK_MAP. The ACK only moves with the
+ * slots received in order.
+ *
+ * With erasure coding, a coded packet is kept in the place of a missing
+ * slot, the gaps are not asked for until the last coded packet or the
+ * next page shows up, and the ACK moves past them.
+ *
+ * @param fill   Set for a fill packet.
+ * @param coded  Set for a coded packet.
+ * @param intact Set when the packet CRC matched.
+ * @return ETX_OTA_EX_OK if the packet was handled, ETX_OTA_EX_ERR if it does not fit its slot.
+ */
+static ETX_OTA_EX_ r_process_slot_pack(uint8_t fill, uint8_t coded, uint8_t intact);
+
+/**
+ * @brief Acknowledge up to the first slot still missing and program the page once complete.
+ * @param slots  Slots of the page.
+ * @param length Bytes of the page just placed.
+ * @return ETX_OTA_EX_OK.
+ */
+static ETX_OTA_EX_ r_slot_advance(uint32_t slots, uint32_t length);
+
+/**
+ * @brief Slots a gap in front of slot count leaves missing, to be asked for right away.
+ * @param count Slot of the packet that arrived.
+ * @return One bit per slot, none while erasure coding may still rebuild them.
+ */
+static uint32_t r_slot_gap(uint32_t count);
+
+/**
+ * @brief Send ETX_OTA_RESP_NACK_MAP for the given slots that are missing
+ * and were not asked for yet.
+ * @param slots Slots to check, one bit each.
+ * @param seq   Sequence number of the packet being handled.
+ */
+static void r_request_slots(uint32_t slots, uint16_t seq);
+
+/**
+ * @brief Mask of the first slots of a page.
+ * @param count Number of slots.
+ * @return One bit set per slot.
+ */
+static uint32_t r_slot_mask(uint32_t count);
+#endif
+
+#if (R_OTA_ERASURE != 0)
+/**
+ * @brief Keep the coded packet in g_rx_buffer in the place of a missing slot.
+ *
+ * Dropped if every missing slot already holds one or one with the same row.
+ *
+ * @param slots Slots of the page.
+ */
+static void r_erasure_store(uint32_t slots);
+
+/**
+ * @brief Rebuild the missing slots once each of them holds a coded packet.
+ * @param slots    Slots of the page.
+ * @param page_len Bytes of the page.
+ * @return Bytes of the page rebuilt, 0 if none.
+ */
+static uint32_t r_erasure_rebuild(uint32_t slots, uint32_t page_len);
+#endif
+
+#if (R_OTA_PACKET_CRC != 0)
+/**
+ * @brief Check the CRC of the data (or fill) packet in g_rx_buffer.
+ *
+ * The CRC follows the data_len bytes the packet carries, which must
+ * already be checked against the negotiated data size.
+ *
+ * @return 1 if the packet arrived intact.
+ */
+static uint8_t r_data_crc_ok(void);
+#endif
+
+#if (R_OTA_FEC != 0)
+/**
+ * @brief Correct the data packet in g_rx_buffer with its FEC parity and drop the parity.
+ *
+ * The CRC is moved right after the data and data_len no longer counts the
+ * parity, so the packet is processed as if it had been sent without it.
+ * A packet the parity cannot fix is left for the packet CRC to reject.
+ */
+static void r_fec_unwrap(void);
+#endif
+
+/**
+ * @brief Reset the page assembly and window state for a new update.
+ */
+static void r_session_reset(void);
+
+/**
+ * @brief Process the resume command.
+ *
+ * Moves the session after the pages committed to the update journal
+ * and answers ETX_OTA_RESP_RESUME with the image offset the host must
+ * continue from (0 when nothing can be resumed).
+ *
+ * @return ETX_OTA_EX_OK if accepted, ETX_OTA_EX_ERR once data was received.
+ */
+static ETX_OTA_EX_ r_resume_session(void);
+
+/**
+ * @brief Apply the page index of a bulk header (ETX_OTA_BULK_HEADER_PAGE_).
+ *
+ * In page-diff mode, the unchanged pages the host left out are kept as
+ * they are: added to the running CRC and skipped, up to the end of the
+ * image if the bulk header points past its last page.
+ *
+ * @return HAL_OK if the bulk header follows the current page, HAL_ERROR otherwise.
+ */
+static HAL_StatusTypeDef r_bulk_skip_pages(void);
+
+#if (R_OTA_PAGE_DIFF != 0)
+/**
+ * @brief Send ETX_OTA_RESP_PAGE_CRC for every page of the announced image,
+ * computed over the application currently in flash.
+ */
+static void r_send_page_crcs(void);
+#endif
+
+#if (R_OTA_RESUME != 0)
+/**
+ * @brief Commit the page just written in the background to the update journal.
+ */
+static void r_journal_add_page(void);
+
+/**
+ * @brief Record a page of the current update in the journal, starting it if needed.
+ * @param page Page index from APP_A_ADDRESS.
+ */
+static void r_journal_commit(uint32_t page);
+#endif
+
+/**
+ * @brief Send a response packet (ETX_OTA_RESP_) through the update UART.
+ * @param status Response status.
+ * @param error  Why a NACK was sent, ETX_OTA_ERR_NONE otherwise.
+ * @param seq    Sequence number (or page), 0 if unused.
+ * @param arg0   First argument, 0 if unused.
+ * @param arg1   Second argument, 0 if unused.
+ */
+static void r_send_response(ETX_OTA_RESP_STATUS_ status, ETX_OTA_RESP_ERR_ error, uint16_t seq, uint32_t arg0, uint32_t arg1);
+
+#if (R_OTA_SET_BAUD != 0)
+/**
+ * @brief Process ETX_OTA_CMD_SET_BAUD (ETX_OTA_COMMAND_BAUD_).
+ *
+ * A new rate is answered with ETX_OTA_RESP_BAUD at the current rate and
+ * switched to right after. The same rate received again, now at the new
+ * rate, is the confirmation and is answered the same way.
+ */
+static void r_set_baud(void);
+#endif
+
+#if (R_UART_LISTEN_BOTH != 0)
+/**
+ * @brief Check that g_rx_buffer holds a packet that starts a session.
+ *
+ * A start or set baud rate command, or a header, with the length of its
+ * kind. Only these bind the UART they came from (see r_uart_bind()).
+ *
+ * @return 1 if it starts a session, 0 otherwise.
+ */
+static uint8_t r_session_packet(void);
+#endif
 // End Private function prototypes ------------------------------------------------------------------------------------
 
 
@@ -163,41 +649,100 @@ r_receive_update()
 {
 		
 	
-		if(g_ota_state == ETX_OTA_STATE_IDLE)
+		if(s_frame_error != 0)
+		{
+			// Bad frame, g_rx_buffer was not written: the host resends from the next packet expected
+			s_frame_error = 0;
+			if(p_uart != NULL)
+			{
+				r_send_response(ETX_OTA_RESP_NACK, ETX_OTA_ERR_FRAME, s_next_seq, 0, 0);
+			}
+			return;
+		}
+		
+		ETX_OTA_COMMAND_ *cmd = (ETX_OTA_COMMAND_*)g_rx_buffer;
+#if (R_UART_LISTEN_BOTH != 0)
+		if(p_uart == NULL)
+		{
+			if(r_session_packet() == 0)
+			{
+				// Noise on a UART nobody talks through yet gets no answer
+				memset_s((void*)g_rx_buffer, R_OTA_PACKET_BUFFER_SIZE, 0);
+				return;
+			}
+			
+			// The UART that starts the session keeps it, the other one stops listening
+			p_uart = r_uart_bind();
+		}
+#endif
+		
+#if (R_OTA_SET_BAUD != 0)
+		if((cmd->packet_type == ETX_OTA_PACKET_TYPE_CMD) && (cmd->cmd == ETX_OTA_CMD_SET_BAUD))
+		{
+			r_set_baud();
+			memset_s((void*)g_rx_buffer, R_OTA_PACKET_BUFFER_SIZE, 0);
+			return;
+		}
+#endif
+		
+		if((cmd->packet_type == ETX_OTA_PACKET_TYPE_CMD) && (cmd->cmd == ETX_OTA_CMD_START))
+		{
+			// Host reconnecting after a link loss: drop the session, the journal keeps the committed pages
+			r_session_reset();
+			g_ota_state = ETX_OTA_STATE_IDLE;
+			memset_s((void*)g_rx_buffer, R_OTA_PACKET_BUFFER_SIZE, 0);
+			
+			// The host waits for the ACK, so the UART clock can change now
+			r_clock_update_profile();
+			
+			r_send_ack();
+			return;
+		}
+		
+		// Accepted in any state, so a header also restarts an update interrupted by a link loss
+		ETX_OTA_HEADER_ *header = (ETX_OTA_HEADER_*)g_rx_buffer;
+		if(header->packet_type == ETX_OTA_PACKET_TYPE_HEADER)
 		{
+			// A corrupted size or option would restart the session with it, so the header is always checked
+			if((header->data_len != sizeof(meta_info)) || (r_calculate_word_crc((uint8_t *)&header->meta_data) != header->crc))
+			{
+				memset_s((void*)g_rx_buffer, R_OTA_PACKET_BUFFER_SIZE, 0);
+				r_send_response(ETX_OTA_RESP_NACK, ETX_OTA_ERR_CRC, 0, 0, 0);
+				return;
+			}
 			
-			ETX_OTA_HEADER_ *header = (ETX_OTA_HEADER_*)g_rx_buffer;
-			if(header->packet_type == ETX_OTA_PACKET_TYPE_HEADER)
+#if (R_OTA_SET_BAUD != 0)
+			s_baud_pending = 0;		// Arrived at the new rate, as good as the confirmation
+#endif
+			r_session_reset();
+			
+			EEPROM_Emu_Data ee_flags = r_read_eeprom_data();
+			if(ee_flags.flag_block_updates == FLAG_VALUE_FALSE)
 			{
-				EEPROM_Emu_Data ee_flags = r_read_eeprom_data();
-				if(ee_flags.flag_block_updates == FLAG_VALUE_FALSE)
+				meta_info md = header->meta_data;
+				if(md.package_size <= APP_MAX_SIZE)
 				{
-					meta_info md = header->meta_data;
-					if(md.package_size <= APP_MAX_SIZE)
-					{
-						g_ota_fw_total_size    = 0u;
-						g_ota_fw_received_size = 0u;
-						g_ota_fw_crc           = 0u;
-						s_flag_flash_crc_ok 	 = 0;
-						g_ota_state = ETX_OTA_STATE_HEADER;
-					}
+					g_ota_fw_total_size    = 0u;
+					g_ota_fw_received_size = 0u;
+					g_ota_fw_crc           = 0u;
+					s_flag_flash_crc_ok 	 = 0;
+					g_ota_state = ETX_OTA_STATE_HEADER;
 				}
 			}
 		}
 		
 		ETX_OTA_EX_ status = ETX_OTA_EX_ERR;
+		s_nack_error = ETX_OTA_ERR_PACKET;
 		
 		if(g_ota_state != ETX_OTA_STATE_IDLE)
 		{
 			status = r_process_pack();
-			memset_s((void*)g_rx_buffer, 0, ETX_OTA_PACKET_MAX_SIZE/2);
-			memset_s((void*)g_rx_buffer + ETX_OTA_PACKET_MAX_SIZE/2, 0, (ETX_OTA_PACKET_MAX_SIZE/2)-1);
+			memset_s((void*)g_rx_buffer, R_OTA_PACKET_BUFFER_SIZE, 0);
 		}
 			
 		if(status == ETX_OTA_EX_OK)
 		{
-			HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_5);
-			HAL_Delay(50);
+			// Activity LED: no blocking blink, the host may already be sending the next packets
 			HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_5);
 			if(s_flag_flash_crc_ok)
 			{
@@ -208,28 +753,62 @@ r_receive_update()
 				r_set_eeprom_flags(FLAG_VALUE_FALSE, 0xFFFFFFFF, 0xFFFFFFFF, g_ota_fw_received_size, g_ota_fw_crc);
 				
 				HAL_Delay(2000);
+				r_uart_flush_tx();
 				__disable_irq();
 				NVIC_SystemReset();
 			}
-			else
-			{
-				//Si llego aca es porque algo se escribio mal en la Flash, tengo que pedir el FW nuevamente.
-				/**TO DO: comunicarse con el ESP32 para enviar otra vez el FW*/
-				
-				g_ota_state = ETX_OTA_STATE_IDLE;
-			}
 			
 		} else
 		{
-			HAL_GPIO_TogglePin(GPIOA, GPIO_PIN_9);
-			HAL_Delay(50);
+			// Error LED: no blocking blink either, the main loop keeps draining the UART and the flash
 			HAL_GPIO_TogglePin(GPIOA, GPIO_PIN_9);
 			
-			const uint8_t msg[] = "NACK\n";
-			HAL_UART_Transmit(p_uart, msg, sizeof(msg), HAL_MAX_DELAY);
+			// In window mode the host resends from the next packet expected
+			r_send_response(ETX_OTA_RESP_NACK, s_nack_error, s_next_seq, 0, 0);
 		}
 		
 }
+
+void 
+r_send_ack(void)
+{
+		r_send_response(ETX_OTA_RESP_ACK, ETX_OTA_ERR_NONE, 0, 0, 0);
+}
+void 
+r_flash_pipeline_process(void)
+{
+		r_flash_write_process();
+		
+		if(s_flight_busy && !r_flash_write_busy())
+		{
+			s_flight_busy = 0;
+			
+			// A failed page stays out of the running CRC, so the end command rejects the image
+			if(r_flash_write_result() == HAL_OK)
+			{
+				r_image_crc_add_page();
+#if (R_OTA_RESUME != 0)
+				r_journal_add_page();
+#endif
+			}
+			
+			HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_5);
+			HAL_GPIO_TogglePin(GPIOA, GPIO_PIN_9);
+		}
+}
+
+void 
+r_baud_process(void)
+{
+#if (R_OTA_SET_BAUD != 0)
+		if((s_baud_pending != 0) && ((HAL_GetTick() - s_baud_tick) >= R_OTA_BAUD_CONFIRM_MS))
+		{
+			// The host never spoke at the new rate: go back to where it still listens
+			s_baud_pending = 0;
+			r_uart_set_baud(p_uart, s_baud_previous);
+		}
+#endif
+}
 // End Update FreeRTOS TASK -------------------------------------------------------------------------------------------
 // ====================================================================================================================
 
@@ -243,6 +822,13 @@ r_process_pack(void)
 	
 		ETX_OTA_EX_ ret_val = ETX_OTA_EX_ERR;
 		
+#if (R_OTA_FEC != 0)
+		if(s_fec_granted && ETX_OTA_PACKET_HAS_SEQ(g_rx_buffer[ETX_OTA_PACKET_TYPE_SECTOR]))
+		{
+			r_fec_unwrap();
+		}
+#endif
+		
 		switch(g_ota_state)
 		{
 			
@@ -255,15 +841,182 @@ r_process_pack(void)
 					g_ota_fw_total_size = header->meta_data.package_size;
 					g_ota_fw_crc        = header->meta_data.package_crc;
 					
-					HAL_StatusTypeDef status = r_clean_bank();
+					r_session_reset();
+					r_crc_init(&s_image_crc);
+					
+#if (R_OTA_RESUME != 0)
+					// Pages kept from an interrupted update of this same image, resumed only if the host asks
+					s_resume_pages = r_read_journal_pages(g_ota_fw_total_size, g_ota_fw_crc);
+					s_journal_open = 0;
+					s_erase_start = APP_A_ADDRESS + (s_resume_pages * FLASH_PAGE_SIZE);
+#else
+					s_erase_start = APP_A_ADDRESS;
+#endif
+					
+#if (R_OTA_PAGE_DIFF != 0)
+					// Page-diff: nothing is erased here, every page sent is erased right before it is programmed
+					s_page_diff = ((header->meta_data.reserved2 & ETX_OTA_OPT_PAGE_DIFF) != 0);
+					if(s_page_diff)
+					{
+						s_erase_start = APP_A_ADDRESS + APP_MAX_SIZE;
+					}
+#endif
+					
+#if (R_OTA_LZSS != 0)
+					s_lzss_granted = ((header->meta_data.reserved2 & ETX_OTA_OPT_LZSS) != 0);
+#endif
+#if (R_OTA_DELTA != 0)
+					// The delta reads the installed image, which only page-diff leaves unerased
+					s_delta_granted = ((header->meta_data.reserved2 & ETX_OTA_OPT_DELTA) != 0) && s_page_diff;
+#endif
+#if (R_OTA_FILL != 0)
+					s_fill_granted = ((header->meta_data.reserved2 & ETX_OTA_OPT_FILL) != 0);
+#endif
+#if (R_OTA_SELECTIVE != 0)
+					s_selective_granted = ((header->meta_data.reserved2 & ETX_OTA_OPT_SELECTIVE) != 0);
+#endif
+#if (R_OTA_FEC != 0)
+					s_fec_granted = ((header->meta_data.reserved2 & ETX_OTA_OPT_FEC) != 0);
+#endif
+					
+					// Data size requested by the host: power of two within the packet buffers
+					uint32_t payload = header->meta_data.reserved1;
+					if(payload == 0)
+					{
+						payload = ETX_OTA_DATA_MAX_SIZE;
+					}
+					if(payload > R_OTA_PAYLOAD_MAX)
+					{
+						payload = R_OTA_PAYLOAD_MAX;
+					}
+					if(payload < ETX_OTA_DATA_MIN_SIZE)
+					{
+						payload = ETX_OTA_DATA_MIN_SIZE;
+					}
+					while((payload & (payload - 1U)) != 0)
+					{
+						payload &= (payload - 1U);		// Round down to a power of two
+					}
+					s_payload_size = (uint16_t)payload;
+					
+					// Window requested by the host, clamped to the packets (and their bulk headers) the reception ring can hold
+					uint32_t window = header->meta_data.reserved2 & ETX_OTA_OPT_WINDOW_MASK;
+					uint32_t packet_size = payload + ETX_OTA_DATA_OVERHEAD + sizeof(ETX_OTA_BULK_HEADER_PAGE_);
+#if (R_OTA_ERASURE != 0)
+					packet_size += ETX_OTA_CODED_ROW_SIZE;
+#endif
+#if (R_OTA_FEC != 0)
+					if(s_fec_granted)
+					{
+						packet_size += ETX_OTA_FEC_SIZE(payload);
+					}
+#endif
+					uint32_t ring_limit = (R_UART_RX_RING_SIZE - 1U) / packet_size;
+					if(window > R_OTA_WINDOW_MAX)
+					{
+						window = R_OTA_WINDOW_MAX;
+					}
+#if (R_OTA_ERASURE != 0)
+					// Coded packets need selective retransmission, and the ring keeps room for those of one page
+					s_coded_count = (uint8_t)((header->meta_data.reserved2 & ETX_OTA_OPT_CODED_MASK) >> ETX_OTA_OPT_CODED_SHIFT);
+					if(s_coded_count > ETX_OTA_ERASURE_ROWS)
+					{
+						s_coded_count = ETX_OTA_ERASURE_ROWS;
+					}
+					if(!s_selective_granted || (window == 0U) || ((FLASH_PAGE_SIZE / payload) > ETX_OTA_SLOT_MAP_BITS) || (ring_limit < 2U))
+					{
+						s_coded_count = 0;
+					}
+					if(s_coded_count >= ring_limit)
+					{
+						s_coded_count = (uint8_t)(ring_limit - 1U);
+					}
+					ring_limit -= s_coded_count;
+#endif
+					if(window > ring_limit)
+					{
+						window = ring_limit;
+					}
+					s_window_size = (uint8_t)window;
+					
+#if (R_OTA_SELECTIVE != 0)
+					// One bit per data packet of a page in the slot maps
+					if((s_window_size == 0) || ((FLASH_PAGE_SIZE / payload) > ETX_OTA_SLOT_MAP_BITS))
+					{
+						s_selective_granted = 0;
+					}
+#endif
+					
+#if (R_OTA_ERASE_MODE == R_OTA_ERASE_BANK)
+					HAL_StatusTypeDef status = r_erase_pages(s_erase_start, (APP_A_ADDRESS + APP_MAX_SIZE - s_erase_start) / FLASH_PAGE_SIZE);
+#elif (R_OTA_ERASE_MODE == R_OTA_ERASE_IMAGE)
+					uint32_t image_pages = (g_ota_fw_total_size + FLASH_PAGE_SIZE - 1U) / FLASH_PAGE_SIZE;
+					uint32_t kept_pages = (s_erase_start - APP_A_ADDRESS) / FLASH_PAGE_SIZE;
+					HAL_StatusTypeDef status = (kept_pages < image_pages) ? r_erase_pages(s_erase_start, image_pages - kept_pages) : HAL_OK;
+#else
+					HAL_StatusTypeDef status = HAL_OK;		// Erased page by page in r_flash_queue_page()
+#endif
 				
 					if(status == HAL_OK)
 					{
 						g_ota_state = ETX_OTA_STATE_BULK_HEADER; 
 						ret_val = ETX_OTA_EX_OK;
 						
-						const uint8_t msg[] = "HEADER_OK\n";
-						HAL_UART_Transmit(p_uart, msg, sizeof(msg), HAL_MAX_DELAY);
+						if((header->meta_data.reserved1 == 0) && (header->meta_data.reserved2 == 0))
+						{
+							r_send_response(ETX_OTA_RESP_HEADER_OK, ETX_OTA_ERR_NONE, 0, s_payload_size, 0);
+						} else
+						{
+							// Granted data size, and window and options laid out as in meta_info.reserved2
+							uint32_t granted = s_window_size;
+#if (R_OTA_PAGE_DIFF != 0)
+							if(s_page_diff)
+							{
+								granted |= ETX_OTA_OPT_PAGE_DIFF;
+							}
+#endif
+#if (R_OTA_LZSS != 0)
+							if(s_lzss_granted && (s_window_size != 0))
+							{
+								granted |= ETX_OTA_OPT_LZSS;
+							}
+#endif
+#if (R_OTA_DELTA != 0)
+							if(s_delta_granted && (s_window_size != 0))
+							{
+								granted |= ETX_OTA_OPT_DELTA;
+							}
+#endif
+#if (R_OTA_FILL != 0)
+							if(s_fill_granted)
+							{
+								granted |= ETX_OTA_OPT_FILL;
+							}
+#endif
+#if (R_OTA_SELECTIVE != 0)
+							if(s_selective_granted)
+							{
+								granted |= ETX_OTA_OPT_SELECTIVE;
+							}
+#endif
+#if (R_OTA_FEC != 0)
+							if(s_fec_granted)
+							{
+								granted |= ETX_OTA_OPT_FEC;
+							}
+#endif
+#if (R_OTA_ERASURE != 0)
+							granted |= ((uint32_t)s_coded_count << ETX_OTA_OPT_CODED_SHIFT);
+#endif
+							r_send_response(ETX_OTA_RESP_HEADER_OK, ETX_OTA_ERR_NONE, 0, s_payload_size, granted);
+						}
+						
+#if (R_OTA_PAGE_DIFF != 0)
+						if(s_page_diff)
+						{
+							r_send_page_crcs();
+						}
+#endif
 					}
 				}		
 				
@@ -271,33 +1024,75 @@ r_process_pack(void)
 			}
 			case ETX_OTA_STATE_BULK_HEADER:
 			{
+				ETX_OTA_COMMAND_ *cmd = (ETX_OTA_COMMAND_*)g_rx_buffer;
+				if((cmd->packet_type == ETX_OTA_PACKET_TYPE_CMD) && (cmd->cmd == ETX_OTA_CMD_RESUME))
+				{
+					ret_val = r_resume_session();
+					break;
+				}
+				
+				if(s_window_size != 0)
+				{
+					ret_val = r_process_window_pack();
+					break;
+				}
+				
 				ETX_OTA_BULK_HEADER_ *bulk_header = (ETX_OTA_BULK_HEADER_*)g_rx_buffer;
 				
-				if (bulk_header->packet_type == ETX_OTA_PACKET_TYPE_BULK_HEADER)
+				if ((bulk_header->packet_type == ETX_OTA_PACKET_TYPE_BULK_HEADER) && (r_bulk_skip_pages() == HAL_OK))
 				{
 					g_ota_bulk_crc = bulk_header->bulk_crc;
-						
-					g_ota_state = ETX_OTA_STATE_DATA; 
+					
+					// Stays in END when the unchanged pages reached the end of the image
+					if(g_ota_state != ETX_OTA_STATE_END)
+					{
+						g_ota_state = ETX_OTA_STATE_DATA; 
+					}
 					ret_val = ETX_OTA_EX_OK;
 					
-					const uint8_t msg[] = "BULK_OK\n";
-					HAL_UART_Transmit(p_uart, msg, sizeof(msg), HAL_MAX_DELAY);
+					r_send_response(ETX_OTA_RESP_BULK_OK, ETX_OTA_ERR_NONE, 0, 0, 0);
 				}	
 				break;
 			}
 			
 			case ETX_OTA_STATE_DATA: 
 			{
+				if(s_window_size != 0)
+				{
+					ret_val = r_process_window_pack();
+					break;
+				}
+				
 				HAL_StatusTypeDef exe_state = HAL_ERROR;
 				ETX_OTA_DATA_ *data_pack = (ETX_OTA_DATA_*)g_rx_buffer;
 				
-				if (data_pack->packet_type == ETX_OTA_PACKET_TYPE_DATA)
+				uint8_t fill = 0;
+#if (R_OTA_FILL != 0)
+				fill = s_fill_granted && (data_pack->packet_type == ETX_OTA_PACKET_TYPE_FILL) && r_fill_valid((ETX_OTA_FILL_*)g_rx_buffer);
+#endif
+				
+				if (((data_pack->packet_type == ETX_OTA_PACKET_TYPE_DATA) || fill) && (data_pack->data_len <= s_payload_size))
 				{ 
-					//Grabs the data and stores it in page_buffer. if completes buffer, inserts and saves the remnant
-					exe_state = r_flash_process_data(data_pack->data, data_pack->data_len);
+#if (R_OTA_PACKET_CRC != 0)
+					if(!r_data_crc_ok())
+					{
+						s_nack_error = ETX_OTA_ERR_CRC;
+						break;		// Answered with NACK: the host sends this packet again
+					}
+#endif
 					
-					const uint8_t msg[] = "DATA_OK\n";
-					HAL_UART_Transmit(p_uart, msg, sizeof(msg), HAL_MAX_DELAY);
+#if (R_OTA_FILL != 0)
+					if(fill)
+					{
+						exe_state = r_flash_fill_data((ETX_OTA_FILL_*)g_rx_buffer);
+					} else
+#endif
+					{
+						//Grabs the data and stores it in page_buffer. if completes buffer, inserts and saves the remnant
+						exe_state = r_flash_process_data(data_pack->data, data_pack->data_len);
+					}
+					
+					r_send_response(ETX_OTA_RESP_DATA_OK, ETX_OTA_ERR_NONE, 0, 0, 0);
 					
 					if(exe_state == HAL_OK)
 					{
@@ -307,24 +1102,26 @@ r_process_pack(void)
 						if(g_ota_fw_received_size >= g_ota_fw_total_size)
 						{
 							// Reset values for future updates.
-							s_bank_a_index = APP_A_ADDRESS;
-							s_page_offset = 0;
-							memset_s(s_page_buffer, FLASH_PAGE_SIZE, 0xFF);
+							r_session_reset();
 							
 							g_ota_state = ETX_OTA_STATE_END;
 						}
 						
 						if(g_ota_bulk_crc == s_pagecrc)
 						{
-							const uint8_t msg[] = "ACK";
-							HAL_UART_Transmit(p_uart, msg, sizeof(msg), HAL_MAX_DELAY);
+							r_send_response(ETX_OTA_RESP_ACK, ETX_OTA_ERR_NONE, 0, 0, 0);
 						} else 
 						{
-							const uint8_t msg[] = "NACK\n";
-							HAL_UART_Transmit(p_uart, msg, sizeof(msg), HAL_MAX_DELAY);
+							r_send_response(ETX_OTA_RESP_NACK, ETX_OTA_ERR_PAGE_CRC, 0, 0, 0);
 						}
 						
 						ret_val = ETX_OTA_EX_OK;
+					} else if(s_page_offset != 0)
+					{
+						ret_val = ETX_OTA_EX_OK;		// Page not complete yet: DATA_OK is the whole answer, a NACK would ask for this packet again
+					} else
+					{
+						s_nack_error = r_page_error();
 					}
 				}
 				
@@ -339,13 +1136,16 @@ r_process_pack(void)
 				{
 					if(cmd->cmd == ETX_OTA_CMD_END)
 					{
-						//We do CRC of all the new Firmware stored in Bank
-						s_flash_crc = r_calculate_flash_crc(g_ota_fw_received_size,APP_A_ADDRESS);
-						
+						// The running CRC already covers every programmed page
 						g_ota_state = ETX_OTA_STATE_IDLE;
-						if(s_flash_crc != g_ota_fw_crc)
+						if((s_image_crc.length != g_ota_fw_received_size) || (r_crc_final(&s_image_crc) != g_ota_fw_crc))
 						{
 							ret_val = ETX_OTA_EX_ERR;
+							s_nack_error = ETX_OTA_ERR_IMAGE_CRC;
+#if (R_OTA_RESUME != 0)
+							// Rewriting the EEPROM page drops the journal, so this image is not resumed again
+							r_set_eeprom_flags(0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF);
+#endif
 							
 						} else 
 						{
@@ -362,10 +1162,746 @@ r_process_pack(void)
 		return ret_val;
 }
 
+static ETX_OTA_EX_ 
+r_process_window_pack(void)
+{
+		ETX_OTA_DATA_ *data_pack = (ETX_OTA_DATA_*)g_rx_buffer;
+		
+		if(data_pack->packet_type == ETX_OTA_PACKET_TYPE_BULK_HEADER)
+		{
+			// Only taken at a page boundary, a bulk header in the middle of a page is a retransmission
+			if(s_page_offset == 0)
+			{
+				if(r_bulk_skip_pages() != HAL_OK)
+				{
+					// Skips from a page that did not arrive: resend from the current one
+					if(s_nack_sent == 0)
+					{
+						s_nack_sent = 1;
+						r_send_response(ETX_OTA_RESP_NACK, ETX_OTA_ERR_SEQ, s_next_seq, 0, 0);
+					}
+					return ETX_OTA_EX_OK;
+				}
+				
+				if(g_ota_state == ETX_OTA_STATE_END)
+				{
+					// Unchanged pages up to the end of the image: no ACK will follow, confirm it
+					r_send_response(ETX_OTA_RESP_BULK_OK, ETX_OTA_ERR_NONE, 0, 0, 0);
+					return ETX_OTA_EX_OK;
+				}
+				
+				g_ota_bulk_crc = ((ETX_OTA_BULK_HEADER_*)g_rx_buffer)->bulk_crc;
+				s_bulk_pending = 0;
+				g_ota_state = ETX_OTA_STATE_DATA;
+#if (R_OTA_LZSS != 0)
+				r_lzss_init(&s_lzss);
+#endif
+#if (R_OTA_DELTA != 0)
+				r_delta_init(&s_delta);
+#endif
+#if (R_OTA_SELECTIVE != 0)
+				s_slot_map = 0;
+				s_slot_asked = 0;
+				s_slot_last_asked = 0;
+				s_slot_overrun = 0;
+				s_slot_acked = 0;
+#endif
+#if (R_OTA_ERASURE != 0)
+				s_coded_map = 0;
+#endif
+			}
+			return ETX_OTA_EX_OK;
+		}
+		
+		uint8_t encoded = 0;
+#if (R_OTA_LZSS != 0)
+		encoded |= s_lzss_granted && (data_pack->packet_type == ETX_OTA_PACKET_TYPE_DATA_LZ);
+#endif
+#if (R_OTA_DELTA != 0)
+		encoded |= s_delta_granted && (data_pack->packet_type == ETX_OTA_PACKET_TYPE_DATA_DELTA);
+#endif
+		
+		uint8_t fill = 0;
+#if (R_OTA_FILL != 0)
+		fill = s_fill_granted && (data_pack->packet_type == ETX_OTA_PACKET_TYPE_FILL);
+#endif
+		
+		uint8_t coded = 0;
+#if (R_OTA_ERASURE != 0)
+		coded = (s_coded_count != 0U) && (data_pack->packet_type == ETX_OTA_PACKET_TYPE_CODED);
+		if(coded && s_bulk_pending)
+		{
+			return ETX_OTA_EX_OK;		// Coded packet of a page already complete, never asked for again
+		}
+#endif
+		
+		if(((data_pack->packet_type != ETX_OTA_PACKET_TYPE_DATA) && !encoded && !fill && !coded) || 
+			 (data_pack->data_len > (s_payload_size + (coded ? ETX_OTA_CODED_ROW_SIZE : 0U))))
+		{
+			return ETX_OTA_EX_ERR;
+		}
+		
+		uint16_t seq = s_next_seq;
+		
+		uint8_t intact = 1;
+#if (R_OTA_PACKET_CRC != 0)
+		intact = r_data_crc_ok();
+		if(!intact && (data_pack->seq == s_next_seq))
+		{
+			s_nack_sent = 0;		// The packet the host already resent is corrupted too: ask again
+		}
+#endif
+		
+#if (R_OTA_SELECTIVE != 0)
+		if(s_selective_granted && !s_bulk_pending && !encoded)
+		{
+			return r_process_slot_pack(fill, coded, intact);
+		}
+#endif
+		
+		// Go-back-N: packets after a gap (or corrupted) are dropped, the host resends from s_next_seq
+		if((data_pack->seq != s_next_seq) || s_bulk_pending || !intact)
+		{
+			if(s_nack_sent == 0)
+			{
+				s_nack_sent = 1;
+				r_send_response(ETX_OTA_RESP_NACK, intact ? ETX_OTA_ERR_SEQ : ETX_OTA_ERR_CRC, seq, 0, 0);
+			}
+			return ETX_OTA_EX_OK;
+		}
+		s_nack_sent = 0;
+		
+		HAL_StatusTypeDef exe_state;
+#if (R_OTA_FILL != 0)
+		if(fill)
+		{
+			if(!r_fill_valid((ETX_OTA_FILL_*)g_rx_buffer))
+			{
+				return ETX_OTA_EX_ERR;
+			}
+			exe_state = r_flash_fill_data((ETX_OTA_FILL_*)g_rx_buffer);
+		} else
+#endif
+#if (R_OTA_LZSS != 0) || (R_OTA_DELTA != 0)
+		if(encoded)
+		{
+			exe_state = r_flash_decode_data(data_pack->packet_type, data_pack->data, data_pack->data_len);
+		} else
+#endif
+		{
+			exe_state = r_flash_process_data(data_pack->data, data_pack->data_len);
+		}
+		
+		if((s_page_offset == 0) && (exe_state != HAL_OK))
+		{
+			r_window_page_retry();
+			return ETX_OTA_EX_OK;
+		}
+		
+		r_send_response(ETX_OTA_RESP_ACK, ETX_OTA_ERR_NONE, seq, 0, 0);
+		s_next_seq++;
+		
+		r_window_page_next();
+		
+		return ETX_OTA_EX_OK;
+}
+
+static void 
+r_window_page_retry(void)
+{
+		g_ota_fw_received_size = s_bank_a_index - APP_A_ADDRESS;
+		s_next_seq = s_page_first_seq;
+		s_bulk_pending = 1;
+		s_nack_sent = 1;
+		
+		r_send_response(ETX_OTA_RESP_NACK, r_page_error(), s_next_seq, 0, 0);
+}
+
+static ETX_OTA_RESP_ERR_ 
+r_page_error(void)
+{
+		return (g_ota_bulk_crc == s_pagecrc) ? ETX_OTA_ERR_FLASH : ETX_OTA_ERR_PAGE_CRC;
+}
+
+static void 
+r_window_page_next(void)
+{
+		if(s_page_offset == 0)
+		{
+			// Page programmed, the next one starts with its own bulk header. A compressed page
+			// used fewer packets: its first sequence number is still its image offset / data size
+			s_next_seq = (uint16_t)(g_ota_fw_received_size / s_payload_size);
+			s_page_first_seq = s_next_seq;
+			s_bulk_pending = 1;
+			
+#if (R_OTA_SELECTIVE != 0)
+			if(s_slot_overrun && (g_ota_fw_received_size < g_ota_fw_total_size))
+			{
+				// The packets of this page that came too early were dropped: resend them from its bulk header
+				s_nack_sent = 1;
+				r_send_response(ETX_OTA_RESP_NACK, ETX_OTA_ERR_SEQ, s_next_seq, 0, 0);
+			}
+			s_slot_overrun = 0;
+#endif
+		}
+		
+		if(g_ota_fw_received_size >= g_ota_fw_total_size)
+		{
+			r_session_reset();
+			g_ota_state = ETX_OTA_STATE_END;
+		}
+}
+
+#if (R_OTA_SELECTIVE != 0)
+static ETX_OTA_EX_ 
+r_process_slot_pack(uint8_t fill, uint8_t coded, uint8_t intact)
+{
+		ETX_OTA_DATA_ *data_pack = (ETX_OTA_DATA_*)g_rx_buffer;
+		
+		uint32_t page_start = s_bank_a_index - APP_A_ADDRESS;
+		uint32_t page_len = g_ota_fw_total_size - page_start;
+		if(page_len > FLASH_PAGE_SIZE)
+		{
+			page_len = FLASH_PAGE_SIZE;
+		}
+		uint32_t slots = (page_len + s_payload_size - 1U) / s_payload_size;
+		
+		if(data_pack->seq < s_page_first_seq)
+		{
+			return ETX_OTA_EX_OK;		// Late copy of a packet of a page already programmed
+		}
+		
+		// Slots asked for whose retransmission should have arrived before this packet (the UART keeps the order)
+		uint32_t lost = 0;
+		if((s_slot_asked != 0U) && (data_pack->seq > (s_slot_asked_seq + s_window_size)))
+		{
+			lost = s_slot_asked;		// Sent after everything the host had in flight when it was asked
+		}
+		
+		uint32_t slot = data_pack->seq - s_page_first_seq;
+		if(slot >= slots)
+		{
+			// The next page is already on the way: ask for what this one is missing, its own packets are resent later
+			s_slot_overrun = 1;
+			s_slot_asked &= ~lost;
+			r_request_slots(r_slot_mask(slots), data_pack->seq);
+			return ETX_OTA_EX_OK;
+		}
+		
+#if (R_OTA_ERASURE != 0)
+		if(coded)
+		{
+			// Carries the page first sequence number; a corrupted one is just one coded packet less
+			s_slot_asked &= ~lost;
+			r_request_slots(lost, data_pack->seq);
+			if(!intact || (slot != 0U))
+			{
+				return ETX_OTA_EX_OK;
+			}
+			
+			ETX_OTA_CODED_ *coded_pack = (ETX_OTA_CODED_*)g_rx_buffer;
+			if((coded_pack->data_len != (s_payload_size + ETX_OTA_CODED_ROW_SIZE)) || (coded_pack->row >= s_coded_count))
+			{
+				return ETX_OTA_EX_ERR;
+			}
+			
+			r_erasure_store(slots);
+			uint32_t length = r_erasure_rebuild(slots, page_len);
+			if((length == 0U) && (coded_pack->row == (s_coded_count - 1U)))
+			{
+				// Last coded packet of the page and still missing slots: ask for them
+				r_request_slots(r_slot_mask(slots), data_pack->seq);
+			}
+			return r_slot_advance(slots, length);
+		}
+#endif
+		
+		if(!intact)
+		{
+			// Ask for it again, even if it was a retransmission already
+			s_slot_asked &= ~(lost | (1UL << slot));
+			r_request_slots(r_slot_gap(slot + 1U) | lost, data_pack->seq);
+			return ETX_OTA_EX_OK;
+		}
+		
+		// Bytes of the page the packet covers: up to the next slot or the end of the page
+		uint32_t offset = slot * s_payload_size;
+		uint32_t length = data_pack->data_len;
+#if (R_OTA_FILL != 0)
+		if(fill)
+		{
+			ETX_OTA_FILL_ *fill_pack = (ETX_OTA_FILL_*)g_rx_buffer;
+			if(fill_pack->offset != (page_start + offset))
+			{
+				return ETX_OTA_EX_ERR;
+			}
+			length = fill_pack->length;
+		}
+#endif
+		uint32_t end = offset + length;
+		if((length == 0U) || (end > page_len) || ((end != page_len) && ((end % s_payload_size) != 0U)))
+		{
+			return ETX_OTA_EX_ERR;
+		}
+		
+		uint32_t mask = r_slot_mask((length + s_payload_size - 1U) / s_payload_size) << slot;
+		if((s_slot_map & mask) != 0U)
+		{
+			return ETX_OTA_EX_OK;		// Duplicate of a slot already placed
+		}
+		
+#if (R_OTA_FILL != 0)
+		if(fill)
+		{
+			memset_s(&s_page_buffer[offset], length, ((ETX_OTA_FILL_*)g_rx_buffer)->pattern);
+		} else
+#endif
+		{
+			memcpy_s(&s_page_buffer[offset], FLASH_PAGE_SIZE - offset, data_pack->data, length);
+		}
+		s_slot_map |= mask;
+#if (R_OTA_ERASURE != 0)
+		s_coded_map &= ~mask;		// A coded packet kept in its place is overwritten
+#endif
+		s_nack_sent = 0;
+		
+		if((s_slot_last_asked & mask) != 0U)
+		{
+			// Retransmission of the last NACK_MAP: the ones asked for before it were resent first
+			lost |= s_slot_asked & ~s_slot_last_asked;
+		}
+		s_slot_asked &= ~(mask | lost);
+		s_slot_last_asked &= ~mask;
+		
+		// The slots this packet jumped over were lost
+		r_request_slots(r_slot_gap(slot) | lost, data_pack->seq);
+		
+#if (R_OTA_ERASURE != 0)
+		length += r_erasure_rebuild(slots, page_len);
+#endif
+		
+		return r_slot_advance(slots, length);
+}
+
+static ETX_OTA_EX_ 
+r_slot_advance(uint32_t slots, uint32_t length)
+{
+		if(length == 0U)
+		{
+			return ETX_OTA_EX_OK;		// Nothing placed: nothing to acknowledge or program
+		}
+		
+		// Acknowledge up to the first slot still missing
+		uint16_t first_missing = 0;
+		while((first_missing < slots) && ((s_slot_map & (1UL << first_missing)) != 0U))
+		{
+			first_missing++;
+		}
+		s_next_seq = s_page_first_seq + first_missing;
+		
+		uint32_t acked = first_missing;
+#if (R_OTA_ERASURE != 0)
+		if((s_coded_count != 0U) && (first_missing < slots))
+		{
+			// The gaps may still be rebuilt: acknowledge what arrived so the window keeps moving,
+			// short of the last slot, which would also confirm the coded packets still needed
+			acked = slots - 1U;
+			while((acked > first_missing) && ((s_slot_map & (1UL << (acked - 1U))) == 0U))
+			{
+				acked--;
+			}
+		}
+#endif
+		uint8_t advanced = (acked > s_slot_acked);
+		if(advanced)
+		{
+			s_slot_acked = acked;
+		}
+		
+		HAL_StatusTypeDef exe_state = r_flash_page_advance((uint16_t)length);
+		if((s_page_offset == 0) && (exe_state != HAL_OK))
+		{
+			r_window_page_retry();
+			return ETX_OTA_EX_OK;
+		}
+		
+		if(advanced)
+		{
+			r_send_response(ETX_OTA_RESP_ACK, ETX_OTA_ERR_NONE, (uint16_t)(s_page_first_seq + acked - 1U), 0, 0);
+		}
+		
+		r_window_page_next();
+		
+		return ETX_OTA_EX_OK;
+}
+
+static void 
+r_request_slots(uint32_t slots, uint16_t seq)
+{
+		uint32_t missing = slots & ~s_slot_map & ~s_slot_asked;
+		
+		if(missing != 0U)
+		{
+			s_slot_asked |= missing;
+			s_slot_last_asked = missing;
+			s_slot_asked_seq = seq;
+			
+			r_send_response(ETX_OTA_RESP_NACK_MAP, ETX_OTA_ERR_NONE, s_page_first_seq, missing, 0);
+		}
+}
+
+static uint32_t 
+r_slot_mask(uint32_t count)
+{
+		return (count >= ETX_OTA_SLOT_MAP_BITS) ? 0xFFFFFFFFUL : ((1UL << count) - 1U);
+}
+
+static uint32_t 
+r_slot_gap(uint32_t count)
+{
+#if (R_OTA_ERASURE != 0)
+		// The coded packets that follow the page may still rebuild them, unless the page already fell back
+		if((s_coded_count != 0U) && !s_slot_overrun)
+		{
+			return 0;
+		}
+#endif
+		return r_slot_mask(count);
+}
+#endif
+
+#if (R_OTA_ERASURE != 0)
+static void 
+r_erasure_store(uint32_t slots)
+{
+		ETX_OTA_CODED_ *coded_pack = (ETX_OTA_CODED_*)g_rx_buffer;
+		uint32_t free_slots = r_slot_mask(slots) & ~s_slot_map & ~s_coded_map;
+		
+		if(free_slots == 0U)
+		{
+			return;		// Enough coded packets already
+		}
+		
+		for(uint32_t slot = 0; slot < slots; slot++)
+		{
+			if(((s_coded_map & (1UL << slot)) != 0U) && (s_coded_rows[slot] == coded_pack->row))
+			{
+				return;		// Same combination as one already kept
+			}
+		}
+		
+		uint32_t slot = 0;
+		while((free_slots & (1UL << slot)) == 0U)
+		{
+			slot++;
+		}
+		
+		uint32_t offset = slot * s_payload_size;
+		memcpy_s(&s_page_buffer[offset], FLASH_PAGE_SIZE - offset, coded_pack->data, s_payload_size);
+		s_coded_rows[slot] = coded_pack->row;
+		s_coded_map |= (1UL << slot);
+}
+
+static uint32_t 
+r_erasure_rebuild(uint32_t slots, uint32_t page_len)
+{
+		uint32_t missing = r_slot_mask(slots) & ~s_slot_map;
+		
+		if((missing == 0U) || (s_coded_map != missing))
+		{
+			return 0;
+		}
+		
+		if(r_fec_erasure_decode(s_page_buffer, s_payload_size, (uint8_t)slots, s_coded_map, s_coded_rows) != HAL_OK)
+		{
+			s_coded_map = 0;
+			return 0;
+		}
+		
+		// Bytes of the page the rebuilt slots cover (the last one may be short)
+		uint32_t length = 0;
+		for(uint32_t slot = 0; slot < slots; slot++)
+		{
+			if((missing & (1UL << slot)) != 0U)
+			{
+				uint32_t offset = slot * s_payload_size;
+				length += ((page_len - offset) < s_payload_size) ? (page_len - offset) : s_payload_size;
+				s_erasure_rebuilt++;
+			}
+		}
+		
+		s_slot_map |= missing;
+		s_slot_asked &= ~missing;
+		s_slot_last_asked &= ~missing;
+		s_coded_map = 0;
+		
+		return length;
+}
+#endif
+
+#if (R_OTA_PACKET_CRC != 0)
+static uint8_t 
+r_data_crc_ok(void)
+{
+		ETX_OTA_DATA_ *data_pack = (ETX_OTA_DATA_*)g_rx_buffer;
+		uint32_t crc;
+		
+		// Right after the data, wherever the negotiated data size puts it
+		memcpy_s(&crc, sizeof(crc), &data_pack->data[data_pack->data_len], sizeof(crc));
+		
+		return (r_calculate_word_crc_datapack(data_pack->data, data_pack->data_len) == crc);
+}
+#endif
+
+#if (R_OTA_FEC != 0)
+static void 
+r_fec_unwrap(void)
+{
+		ETX_OTA_DATA_ *data_pack = (ETX_OTA_DATA_*)g_rx_buffer;
+		uint16_t block_len = data_pack->data_len;
+		uint16_t data_len = block_len;
+		
+		// Longer than the buffers hold: left as it is, the data size check rejects it
+		if(block_len > (R_OTA_PACKET_BUFFER_SIZE - ETX_OTA_DATA_OVERHEAD))
+		{
+			return;
+		}
+		
+		// Uncorrectable codewords are left as received, the packet CRC rejects them
+		(void)r_fec_decode(data_pack->data, block_len, &data_len, &s_fec_corrected);
+		
+		if(data_len != block_len)
+		{
+			memcpy_s(&data_pack->data[data_len], sizeof(uint32_t), &data_pack->data[block_len], sizeof(uint32_t));
+			data_pack->data_len = data_len;
+		}
+}
+#endif
+
+static void 
+r_session_reset(void)
+{
+		// The last page (or one from an aborted update) may still be in the flash
+		r_flash_pipeline_wait();
+		
+		s_bank_a_index = APP_A_ADDRESS;
+		s_page_offset = 0;
+		memset_s(s_page_buffer, FLASH_PAGE_SIZE, 0xFF);
+		
+		s_next_seq = 0;
+		s_page_first_seq = 0;
+		s_nack_sent = 0;
+		s_bulk_pending = 1;
+}
+
+#if (R_UART_LISTEN_BOTH != 0)
+static uint8_t 
+r_session_packet(void)
+{
+		ETX_OTA_COMMAND_ *cmd = (ETX_OTA_COMMAND_*)g_rx_buffer;
+		
+		if(cmd->sof != ETX_OTA_SOF)
+		{
+			return 0;
+		}
+		
+		if(cmd->packet_type == ETX_OTA_PACKET_TYPE_CMD)
+		{
+			return ((cmd->cmd == ETX_OTA_CMD_START) && (cmd->data_len == sizeof(cmd->cmd))) ||
+						 ((cmd->cmd == ETX_OTA_CMD_SET_BAUD) && (cmd->data_len == ETX_OTA_CMD_BAUD_DATA_SIZE));
+		}
+		
+		return (cmd->packet_type == ETX_OTA_PACKET_TYPE_HEADER) && (cmd->data_len == sizeof(meta_info));
+}
+#endif
+
+#if (R_OTA_SET_BAUD != 0)
+static void 
+r_set_baud(void)
+{
+		ETX_OTA_COMMAND_BAUD_ *baud_cmd = (ETX_OTA_COMMAND_BAUD_*)g_rx_buffer;
+		
+		// A corrupted rate would lose the link until the timeout, so this command is always checked
+		if((baud_cmd->data_len != ETX_OTA_CMD_BAUD_DATA_SIZE) ||
+			 (r_calculate_word_crc_datapack(&baud_cmd->cmd, ETX_OTA_CMD_BAUD_DATA_SIZE) != baud_cmd->crc))
+		{
+			r_send_response(ETX_OTA_RESP_NACK, ETX_OTA_ERR_CRC, 0, 0, 0);
+			return;
+		}
+		
+		uint32_t baud = baud_cmd->baud;
+		
+		if(s_baud_pending != 0)
+		{
+			if(baud != s_baud_pending)
+			{
+				r_send_response(ETX_OTA_RESP_NACK, ETX_OTA_ERR_BAUD, 0, 0, 0);
+				return;
+			}
+			
+			// Received at the new rate: the host follows, keep it
+			s_baud_pending = 0;
+			r_send_response(ETX_OTA_RESP_BAUD, ETX_OTA_ERR_NONE, 0, baud, 0);
+			return;
+		}
+		
+		// Only between the start command and the header, never in the middle of an update
+		if((g_ota_state != ETX_OTA_STATE_IDLE) || (r_uart_baud_check(p_uart, baud) != HAL_OK))
+		{
+			r_send_response(ETX_OTA_RESP_NACK, ETX_OTA_ERR_BAUD, 0, 0, 0);
+			return;
+		}
+		
+		r_send_response(ETX_OTA_RESP_BAUD, ETX_OTA_ERR_NONE, 0, baud, 0);
+		
+		s_baud_previous = p_uart->Init.BaudRate;
+		r_uart_set_baud(p_uart, baud);
+		s_baud_pending = baud;
+		s_baud_tick = HAL_GetTick();
+}
+#endif
+
+static ETX_OTA_EX_ 
+r_resume_session(void)
+{
+		// Only right after the header, before the first data packet
+		if((g_ota_fw_received_size != 0) || (s_page_offset != 0))
+		{
+			return ETX_OTA_EX_ERR;
+		}
+		
+		uint32_t offset = 0;
+		
+#if (R_OTA_RESUME != 0)
+		offset = s_resume_pages * FLASH_PAGE_SIZE;
+		if(offset > g_ota_fw_total_size)
+		{
+			offset = g_ota_fw_total_size;
+		}
+		
+		// The committed pages are already in flash: add them to the running CRC and continue after them
+		r_crc_update(&s_image_crc, (const uint8_t *)APP_A_ADDRESS, offset);
+		s_bank_a_index = APP_A_ADDRESS + (s_resume_pages * FLASH_PAGE_SIZE);
+		g_ota_fw_received_size = offset;
+		s_next_seq = (uint16_t)(offset / s_payload_size);
+		s_page_first_seq = s_next_seq;
+		s_journal_open = (s_resume_pages != 0);
+		
+		if(g_ota_fw_received_size >= g_ota_fw_total_size)
+		{
+			g_ota_state = ETX_OTA_STATE_END;
+		}
+#endif
+		
+		r_send_response(ETX_OTA_RESP_RESUME, ETX_OTA_ERR_NONE, 0, offset, 0);
+		return ETX_OTA_EX_OK;
+}
+
+static HAL_StatusTypeDef 
+r_bulk_skip_pages(void)
+{
+		ETX_OTA_BULK_HEADER_PAGE_ *bulk_header = (ETX_OTA_BULK_HEADER_PAGE_*)g_rx_buffer;
+		uint32_t current = (s_bank_a_index - APP_A_ADDRESS) / FLASH_PAGE_SIZE;
+		
+		// Plain bulk header, or a retransmission of the current page
+		if((bulk_header->data_len < (sizeof(bulk_header->bulk_crc) + sizeof(bulk_header->page) + sizeof(bulk_header->skip))) || 
+			 (bulk_header->page == current))
+		{
+			return HAL_OK;
+		}
+		
+#if (R_OTA_PAGE_DIFF != 0)
+		// The host must skip from this very page, or a page it sent was lost
+		if(s_page_diff && (current + bulk_header->skip == bulk_header->page))
+		{
+			uint32_t length = bulk_header->skip * FLASH_PAGE_SIZE;
+			if(length > (g_ota_fw_total_size - g_ota_fw_received_size))
+			{
+				length = g_ota_fw_total_size - g_ota_fw_received_size;
+			}
+			
+			// Kept pages go to the running CRC after the page still being written
+			r_flash_pipeline_wait();
+			r_crc_update(&s_image_crc, (const uint8_t *)s_bank_a_index, length);
+			
+#if (R_OTA_RESUME != 0)
+			for(uint32_t page = current; page < bulk_header->page; page++)
+			{
+				r_journal_commit(page);
+			}
+#endif
+			
+			s_bank_a_index += bulk_header->skip * FLASH_PAGE_SIZE;
+			g_ota_fw_received_size += length;
+			s_next_seq = (uint16_t)(g_ota_fw_received_size / s_payload_size);
+			s_page_first_seq = s_next_seq;
+			
+			if(g_ota_fw_received_size >= g_ota_fw_total_size)
+			{
+				r_session_reset();
+				g_ota_state = ETX_OTA_STATE_END;
+			}
+			return HAL_OK;
+		}
+#endif
+		
+		return HAL_ERROR;
+}
+
+#if (R_OTA_PAGE_DIFF != 0)
+static void 
+r_send_page_crcs(void)
+{
+		uint32_t pages = (g_ota_fw_total_size + FLASH_PAGE_SIZE - 1U) / FLASH_PAGE_SIZE;
+		
+		for(uint32_t page = 0; page < pages; page++)
+		{
+			uint32_t length = g_ota_fw_total_size - (page * FLASH_PAGE_SIZE);
+			if(length > FLASH_PAGE_SIZE)
+			{
+				length = FLASH_PAGE_SIZE;
+			}
+			
+			// Same CRC as the bulk header of the page, over the bytes of the new image only
+			uint32_t crc = r_calculate_page_crc((uint8_t *)(APP_A_ADDRESS + (page * FLASH_PAGE_SIZE)), length);
+			r_send_response(ETX_OTA_RESP_PAGE_CRC, ETX_OTA_ERR_NONE, (uint16_t)page, crc, 0);
+		}
+}
+#endif
+
+static void 
+r_send_response(ETX_OTA_RESP_STATUS_ status, ETX_OTA_RESP_ERR_ error, uint16_t seq, uint32_t arg0, uint32_t arg1)
+{
+		ETX_OTA_RESP_ resp;
+		
+		resp.sof         = ETX_OTA_SOF;
+		resp.packet_type = ETX_OTA_PACKET_TYPE_RESPONSE;
+		resp.data_len    = ETX_OTA_RESP_DATA_SIZE;
+		resp.status      = status;
+		resp.error       = error;
+		resp.seq         = seq;
+		resp.arg0        = arg0;
+		resp.arg1        = arg1;
+		resp.crc         = r_calculate_word_crc_datapack((uint8_t *)&resp.status, ETX_OTA_RESP_DATA_SIZE);
+		resp.saltoLinea  = ETX_OTA_SALTO_LINEA;
+		resp.finLinea    = ETX_OTA_FIN_LINEA;
+		
+		// Queued in R_UART_TX_MODE_IT/DMA: the page keeps being processed while it goes out
+		if(p_uart != NULL)
+		{
+			r_uart_send(p_uart, (uint8_t *)&resp, sizeof(resp));
+		} else
+		{
+			// No session yet (boot ACK): the host is on one of the UARTs listening
+			r_uart_send_listening((uint8_t *)&resp, sizeof(resp));
+		}
+}
+
 
 // Start BANK FUNCTIONALITY -------------------------------------------------------------------------------------------
+#if (R_OTA_ERASE_MODE != R_OTA_ERASE_PAGE)
 static HAL_StatusTypeDef 
-r_clean_bank(void)
+r_erase_pages(uint32_t address, uint32_t nb_pages)
 {
 		HAL_StatusTypeDef status = HAL_ERROR;
 
@@ -380,8 +1916,8 @@ r_clean_bank(void)
     uint32_t pageError = 0;
 
     eraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
-    eraseInit.Page = (APP_A_ADDRESS - REAL_FLASH_START) / FLASH_PAGE_SIZE;
-    eraseInit.NbPages = (APP_MAX_SIZE / FLASH_PAGE_SIZE);
+    eraseInit.Page = (address - REAL_FLASH_START) / FLASH_PAGE_SIZE;
+    eraseInit.NbPages = nb_pages;
 	
     // Borrado de pginas
 		status = HAL_FLASHEx_Erase(&eraseInit, &pageError);
@@ -395,37 +1931,53 @@ r_clean_bank(void)
     return status;
 			
 }
+#endif
 // End BANK FUNCTIONALITY ---------------------------------------------------------------------------------------------
 
 // Start PAGE/DATA FUNCTIONALITY --------------------------------------------------------------------------------------
 static HAL_StatusTypeDef 
-r_flash_program_page(uint32_t address, uint8_t* data) 
+r_flash_queue_page(uint32_t address, uint16_t length) 
 {
-		HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_5);
-		HAL_GPIO_TogglePin(GPIOA, GPIO_PIN_9);
-	
-		HAL_FLASH_Unlock();
-    for (uint32_t i = 0; i < FLASH_PAGE_SIZE; i += 8) 
+		// Flow control: only blocks while the other buffer is still being written
+		r_flash_pipeline_wait();
+		
+		// Lazy erase: the DMA keeps filling the reception ring during the erase
+		uint8_t erase = (R_OTA_ERASE_MODE == R_OTA_ERASE_PAGE) || (address < s_erase_start);
+		if(r_flash_write_page_start(address, s_page_buffer, erase) != HAL_OK)
 		{
-        uint64_t data64 = 0;
-        memcpy_s(&data64, sizeof(uint64_t), data + i, sizeof(uint64_t));
-        HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address + i, data64);
-    }
-		HAL_FLASH_Lock();
+			return HAL_ERROR;
+		}
 		
 		HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_5);
 		HAL_GPIO_TogglePin(GPIOA, GPIO_PIN_9);
 		
+		s_flight_address = address;
+		s_flight_length = length;
+		s_flight_data = s_page_buffer;
+		s_flight_busy = 1;
+		
+		// Keep assembling the next page in the other buffer
+		s_page_buffer = (s_page_buffer == s_page_buffers[0]) ? s_page_buffers[1] : s_page_buffers[0];
+		
 		return HAL_OK;
 }
 
+static void 
+r_flash_pipeline_wait(void)
+{
+		while(s_flight_busy)
+		{
+			r_flash_pipeline_process();
+			
+			// The framer waits too: RTS holds the host once the ring is nearly full
+			r_uart_flow_control();
+		}
+}
+
 static HAL_StatusTypeDef 
 r_flash_process_data(uint8_t *data, uint16_t data_len)
 {
 
-		HAL_StatusTypeDef status = HAL_ERROR;
-		const char *msg2;
-
 		uint16_t space_left = FLASH_PAGE_SIZE - s_page_offset;
 		uint16_t bytes_to_copy = data_len;
 
@@ -434,9 +1986,81 @@ r_flash_process_data(uint8_t *data, uint16_t data_len)
 
 		// Copy data into page_buffer with correct offset
 		memcpy_s(&s_page_buffer[s_page_offset], FLASH_PAGE_SIZE, data, bytes_to_copy);
-		s_page_offset += bytes_to_copy;
 		
-		g_ota_fw_received_size += bytes_to_copy; // Add the inserted data size
+		return r_flash_page_advance(bytes_to_copy);
+}
+
+#if (R_OTA_LZSS != 0) || (R_OTA_DELTA != 0)
+static HAL_StatusTypeDef 
+r_flash_decode_data(uint8_t packet_type, uint8_t *data, uint16_t data_len)
+{
+		// The page ends at FLASH_PAGE_SIZE, or earlier on the last page of the image
+		uint32_t page_end = FLASH_PAGE_SIZE;
+		if((g_ota_fw_total_size - g_ota_fw_received_size) < (page_end - s_page_offset))
+		{
+			page_end = s_page_offset + (g_ota_fw_total_size - g_ota_fw_received_size);
+		}
+		
+		uint16_t in_len = data_len;
+		uint16_t out_pos = s_page_offset;
+		HAL_StatusTypeDef status = HAL_ERROR;
+		
+#if (R_OTA_LZSS != 0)
+		if(packet_type == ETX_OTA_PACKET_TYPE_DATA_LZ)
+		{
+			status = r_lzss_decode(&s_lzss, data, &in_len, s_page_buffer, &out_pos, (uint16_t)page_end);
+		}
+#endif
+#if (R_OTA_DELTA != 0)
+		if(packet_type == ETX_OTA_PACKET_TYPE_DATA_DELTA)
+		{
+			// The pages before this one may already hold the new image
+			R_DELTA_SRC_ src = { (const uint8_t *)APP_A_ADDRESS, s_bank_a_index - APP_A_ADDRESS, APP_MAX_SIZE };
+			status = r_delta_decode(&s_delta, &src, data, &in_len, s_page_buffer, s_bank_a_index - APP_A_ADDRESS, &out_pos, (uint16_t)page_end);
+		}
+#endif
+		
+		if((status != HAL_OK) || (in_len != data_len))
+		{
+			// Broken stream, or more data than the page holds: drop the page
+			g_ota_fw_received_size -= s_page_offset;
+			memset_s(s_page_buffer, FLASH_PAGE_SIZE, 0xFF);
+			s_page_offset = 0;
+			return HAL_ERROR;
+		}
+		
+		return r_flash_page_advance(out_pos - s_page_offset);
+}
+#endif
+
+#if (R_OTA_FILL != 0)
+static uint8_t 
+r_fill_valid(const ETX_OTA_FILL_ *fill)
+{
+		return (fill->offset == g_ota_fw_received_size) && (fill->length != 0U) &&
+					 (fill->length <= (FLASH_PAGE_SIZE - s_page_offset)) &&
+					 (fill->length <= (g_ota_fw_total_size - g_ota_fw_received_size));
+}
+
+static HAL_StatusTypeDef 
+r_flash_fill_data(const ETX_OTA_FILL_ *fill)
+{
+		// Nothing else to receive: the writer also skips programming the rows left at 0xFF
+		memset_s(&s_page_buffer[s_page_offset], fill->length, fill->pattern);
+		
+		return r_flash_page_advance(fill->length);
+}
+#endif
+
+static HAL_StatusTypeDef 
+r_flash_page_advance(uint16_t length)
+{
+
+		HAL_StatusTypeDef status = HAL_ERROR;
+
+		s_page_offset += length;
+		
+		g_ota_fw_received_size += length; // Add the inserted data size
 
 		// Page_buffer full? we flash it into memory
 		if (s_page_offset == FLASH_PAGE_SIZE) 
@@ -444,8 +2068,11 @@ r_flash_process_data(uint8_t *data, uint16_t data_len)
 				s_pagecrc = r_calculate_page_crc(s_page_buffer, FLASH_PAGE_SIZE);
 				if(g_ota_bulk_crc == s_pagecrc)
 				{
-					status = r_flash_program_page(s_bank_a_index, s_page_buffer);
-					s_bank_a_index += FLASH_PAGE_SIZE;
+					status = r_flash_queue_page(s_bank_a_index, FLASH_PAGE_SIZE);
+					if(status == HAL_OK)
+					{
+						s_bank_a_index += FLASH_PAGE_SIZE;
+					}
 				}
 				
 				memset_s(s_page_buffer, FLASH_PAGE_SIZE, 0xFF); // Cleaning
@@ -458,7 +2085,10 @@ r_flash_process_data(uint8_t *data, uint16_t data_len)
 				if(g_ota_bulk_crc == s_pagecrc)
 				{
 					status = r_flash_program_last_data();
-					s_bank_a_index += FLASH_PAGE_SIZE;
+					if(status == HAL_OK)
+					{
+						s_bank_a_index += FLASH_PAGE_SIZE;
+					}
 				}
 				
 				memset_s(s_page_buffer, FLASH_PAGE_SIZE, 0xFF); // Cleaning
@@ -480,9 +2110,45 @@ r_flash_program_last_data()
     }
 
     // Flash Last Page
-		status = r_flash_program_page(s_bank_a_index, s_page_buffer);
+		status = r_flash_queue_page(s_bank_a_index, s_page_offset);
 		return status;
 
 }
+
+static void 
+r_image_crc_add_page(void)
+{
+#if (R_OTA_CRC_READBACK != 0)
+		// Read back what was programmed, a failed write shows up as a CRC mismatch at the end
+		r_crc_update(&s_image_crc, (const uint8_t *)s_flight_address, s_flight_length);
+#else
+		r_crc_update(&s_image_crc, s_flight_data, s_flight_length);
+#endif
+}
+
+#if (R_OTA_RESUME != 0)
+static void 
+r_journal_add_page(void)
+{
+		// Only a page that reads back exactly as received can be skipped by a resume
+		if(memcmp((const void *)s_flight_address, s_flight_data, s_flight_length) != 0)
+		{
+			return;
+		}
+		
+		r_journal_commit((s_flight_address - APP_A_ADDRESS) / FLASH_PAGE_SIZE);
+}
+
+static void 
+r_journal_commit(uint32_t page)
+{
+		if(!s_journal_open)
+		{
+			r_start_journal(g_ota_fw_total_size, g_ota_fw_crc);
+			s_journal_open = 1;
+		}
+		r_commit_journal_page(page);
+}
+#endif
 // End PAGE/DATA FUNCTIONALITY ----------------------------------------------------------------------------------------
 // ====================================================================================================================
\ No newline at end of file
@@ -21,6 +21,25 @@ extern uint32_t crc;
 
 void r_led_burst();
 
+/**
+ * @brief Switch to the clock profile selected by R_OTA_CLOCK_PROFILE for an update.
+ *
+ * Called before the start command is answered. Does nothing if the
+ * profile is already running. The UARTs receiving keep their baud rates.
+ *
+ * @return HAL_OK, or HAL_ERROR if the clock could not be switched (the update goes on at the boot clock).
+ */
+HAL_StatusTypeDef r_clock_update_profile(void);
+
+/**
+ * @brief Put the clocks back to their state after a reset.
+ *
+ * MSI 4 MHz as system clock, PLL and MSI PLL mode off, no flash wait
+ * states and regulator range 1, so the App clock setup starts from the
+ * same point whether it boots from reset or from the bootloader.
+ */
+void r_clock_reset_state(void);
+
 /**
  * @brief Jump execution to the user application.
  *
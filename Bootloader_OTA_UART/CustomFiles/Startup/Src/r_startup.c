@@ -14,12 +14,15 @@
  * @details
  * Key functions provided:
  * - `r_go_to_app()`: De-initialize system and jump to application reset handler.
+ * - `r_clock_update_profile()` / `r_clock_reset_state()`: Clock used during an
+ *   update and the reset clock state handed to the application.
  * - `r_startup_routine()`: Bootloader startup sequence that verifies update 
  *   flags, handles bank swaps, performs CRC validation, and decides the 
  *   execution path (update or run application).
  */
 
 #include "r_startup.h"
+#include "r_uart_callback.h"
 
 #define APP_NUM_PAGES (APP_MAX_SIZE / FLASH_PAGE_SIZE)
 
@@ -41,11 +44,90 @@ void r_led_burst()
 	HAL_Delay(200);
 }
 
+// Start CLOCK PROFILE ------------------------------------------------------------------------------------------------
+HAL_StatusTypeDef 
+r_clock_update_profile(void)
+{
+#if (R_OTA_CLOCK_PROFILE == R_OTA_CLOCK_PLL_48MHZ)
+	RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+	RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
+	
+	if(__HAL_RCC_GET_SYSCLK_SOURCE() == RCC_SYSCLKSOURCE_STATUS_PLLCLK)
+	{
+		return HAL_OK;		// Already switched by a previous start command
+	}
+	
+	// The UART clock changes under the bytes still queued
+	r_uart_flush_tx();
+	
+	// 48 MHz needs range 1 of the main regulator, raised before the clock
+	if(HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE1) != HAL_OK)
+	{
+		return HAL_ERROR;
+	}
+	
+	// MSI 4 MHz / 1 * 48 / 4 = 48 MHz, VCO at 192 MHz
+	RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+	RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
+	RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_MSI;
+	RCC_OscInitStruct.PLL.PLLM = RCC_PLLM_DIV1;
+	RCC_OscInitStruct.PLL.PLLN = 48;
+	RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV2;
+	RCC_OscInitStruct.PLL.PLLQ = RCC_PLLQ_DIV2;
+	RCC_OscInitStruct.PLL.PLLR = RCC_PLLR_DIV4;
+	if(HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
+	{
+		return HAL_ERROR;
+	}
+	
+	// MSI locked on the LSE, so the baud rate error stays the one of the BRR division
+	if(__HAL_RCC_GET_FLAG(RCC_FLAG_LSERDY) != 0U)
+	{
+		HAL_RCCEx_EnableMSIPLLMode();
+	}
+	
+	RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK3|RCC_CLOCKTYPE_HCLK
+															|RCC_CLOCKTYPE_SYSCLK|RCC_CLOCKTYPE_PCLK1
+															|RCC_CLOCKTYPE_PCLK2;
+	RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
+	RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
+	RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV1;
+	RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV1;
+	RCC_ClkInitStruct.AHBCLK3Divider = RCC_SYSCLK_DIV1;
+	if(HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_2) != HAL_OK)
+	{
+		return HAL_ERROR;
+	}
+	
+	// Same baud rates, BRR computed again from the new UART clock
+	return r_uart_clock_changed();
+#else
+	return HAL_OK;
+#endif
+}
+
+void 
+r_clock_reset_state(void)
+{
+	// MSI 4 MHz as system clock, PLL off, prescalers at their reset value
+	HAL_RCC_DeInit();
+	
+	// What HAL_RCC_DeInit() leaves: MSI PLL mode, wait states and regulator range
+	HAL_RCCEx_DisableMSIPLLMode();
+	__HAL_FLASH_SET_LATENCY(FLASH_LATENCY_0);
+	HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE1);
+}
+// End CLOCK PROFILE --------------------------------------------------------------------------------------------------
+
 // Start GO TO APP ----------------------------------------------------------------------------------------------------
 void 
 r_go_to_app(uint32_t app_address)
 {
 	
+	// Let the last response go out, then stop the UART reception so no DMA transfer keeps writing into bootloader RAM
+	r_uart_flush_tx();
+	r_uart_stop_reception();
+	
 	// De-initialize peripherals and release GPIO resources if required
 	HAL_GPIO_DeInit(GPIOB, GPIO_PIN_5);		// Release pin PA5
 	HAL_GPIO_DeInit(GPIOA, GPIO_PIN_9);
@@ -53,8 +135,8 @@ r_go_to_app(uint32_t app_address)
 	__HAL_RCC_GPIOA_CLK_DISABLE();  			// Disable GPIOA clock
 	__HAL_RCC_GPIOB_CLK_DISABLE();  			// Disable GPIOA clock
 	
-	// Reset clock configuration and HAL state
-	HAL_RCC_DeInit();
+	// Reset clock configuration and HAL state, so the App starts from the clocks of a reset
+	r_clock_reset_state();
   HAL_DeInit();
 	
 	// Disable SysTick timer to avoid unwanted interrupts during app execution
@@ -65,6 +147,13 @@ r_go_to_app(uint32_t app_address)
 	// Disable all interrupts
 	__disable_irq();						
 	
+	// Disable and clear every NVIC line left enabled/pending by the bootloader (UART, DMA)
+	for(uint8_t i = 0; i < (sizeof(NVIC->ICER) / sizeof(NVIC->ICER[0])); i++)
+	{
+		NVIC->ICER[i] = 0xFFFFFFFFU;
+		NVIC->ICPR[i] = 0xFFFFFFFFU;
+	}
+	
 	// Relocate vector table to the application's address
 	SCB->VTOR = app_address;		
 	
@@ -5,7 +5,7 @@
  * @details
  * This file specifies the flash memory layout for:
  * - Application Bank A,
- * - EEPROM emulation storage,
+ * - EEPROM emulation storage and update journal,
  * - Real flash start address reference.
  *
  * These definitions are used by the bootloader and application to 
@@ -24,6 +24,11 @@
  * @brief Address reserved for EEPROM emulation in flash.*/
 #define EEPROM_ADDRESS  			0x0803E800UL
 
+/**
+ * @brief Address of the update journal, in the EEPROM emulation page after its data.
+ * Erased together with the EEPROM data on every r_write_eeprom_data().*/
+#define OTA_JOURNAL_ADDRESS		(EEPROM_ADDRESS + 0x100UL)
+
 //LoRaWAN NVM -> 0x0803F000UL
 
 /**
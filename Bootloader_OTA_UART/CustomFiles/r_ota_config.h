@@ -0,0 +1,399 @@
+/**
+ * @file r_ota_config.h
+ * @brief Build-time configuration of the OTA bootloader transport and update pipeline.
+ *
+ * @author Manuel Martinez Leanes
+ * @date 17/10/2026
+ *
+ * @details
+ * This file groups the options that select how the bootloader receives
+ * and processes an update:
+ * - UART reception and transmission modes, buffer sizes and flow control.
+ * - Baud rate negotiation with the host and clock profile during updates.
+ * - Largest data size per packet, per-packet CRC check and FEC.
+ * - Data packets in flight (window mode), selective retransmission and
+ *   erasure coded pages.
+ * - Application region erase strategy and flash programming mode.
+ * - Resume of an interrupted update and page-diff updates.
+ * - Compressed, delta and fill data packets.
+ * - Image CRC source and CRC calculation backend.
+ *
+ * Every option has a default that matches the current hardware; change
+ * them here instead of editing the modules that use them.
+ */
+
+#ifndef R_OTA_CONFIG_H
+#define R_OTA_CONFIG_H
+
+// Start UART RECEPTION -----------------------------------------------------------------------------------------------
+/** UART reception with one interrupt per received byte. */
+#define R_UART_RX_MODE_IT						0
+
+/** UART reception through a circular DMA ring and idle-line/half/full events. */
+#define R_UART_RX_MODE_DMA					1
+
+/** UART reception through the RX FIFO, several bytes per threshold interrupt. */
+#define R_UART_RX_MODE_FIFO					2
+
+/**
+ * @brief Selected UART reception mode.
+ *
+ * Whatever the mode, the received bytes land in the same ring buffer and
+ * the packet framer runs from the main loop (see r_uart_process_rx()).
+ */
+#define R_UART_RX_MODE							R_UART_RX_MODE_DMA
+
+/**
+ * @brief RX FIFO level that raises the interrupt with R_UART_RX_MODE_FIFO.
+ *
+ * The interrupt reads as many bytes as the threshold (6 of the 8 with
+ * 3/4), the idle line collects the tail of a packet. A higher threshold
+ * means fewer interrupts but less time to serve them before an overrun.
+ */
+#define R_UART_RX_FIFO_THRESHOLD		UART_RXFIFO_THRESHOLD_3_4
+
+/**
+ * @brief Size in bytes of the UART reception ring buffer.
+ *
+ * Must hold every byte that can arrive while the main loop is busy
+ * (flash erase/program, CRC), so keep it above one full packet.
+ * In window mode it also bounds the negotiated window.
+ */
+#define R_UART_RX_RING_SIZE					8192U
+
+/**
+ * @brief Milliseconds without a byte after which the framer gives up on a frame.
+ *
+ * A frame cut short, or bytes dropped while hunting for a SOF, with no
+ * packet after them, get one NACK with ETX_OTA_ERR_FRAME once the line
+ * has been quiet this long. Keep it above the longest gap the host (or
+ * the ESP32 bridge) leaves inside a frame.
+ */
+#define R_UART_FRAME_TIMEOUT_MS			100U
+
+/**
+ * @brief Listen on USART1 (ESP32) and USART2 (PC) at once.
+ *
+ * Until a session starts each UART receives into half of the ring and
+ * the answers go out through both. The first one that delivers a start,
+ * set baud rate or header command becomes p_uart and keeps the whole
+ * ring; the other one stops listening until the next reset. With 0 only
+ * p_uart, set in main.c, is listened to.
+ */
+#define R_UART_LISTEN_BOTH					1
+
+/**
+ * @brief Hardware flow control of the UARTs (UART_HWCONTROL_NONE, _RTS or _RTS_CTS).
+ *
+ * With RTS, the reception stops reading the UART while the ring has less
+ * than R_UART_RTS_ROOM bytes free (packet buffer waiting, both page
+ * buffers being written), so the UART deasserts RTS and the host holds
+ * the next bytes instead of being paced by fixed delays. The RTS pin
+ * (PA1 on USART2, PB3 on USART1) goes to the CTS input of the host. With
+ * _RTS_CTS the CTS pin (PA0 on USART2, which the LED then loses; PB4 on
+ * USART1) goes to its RTS output.
+ */
+#define R_UART_FLOW_CONTROL					UART_HWCONTROL_NONE
+
+/**
+ * @brief Free bytes in the reception ring under which RTS is deasserted.
+ *
+ * Must cover what arrives between two checks of the main loop; the
+ * reception resumes once twice this room is free again.
+ */
+#define R_UART_RTS_ROOM							2048U
+
+#if (R_UART_FLOW_CONTROL != UART_HWCONTROL_NONE) && ((2U * R_UART_RTS_ROOM) >= R_UART_RX_RING_SIZE)
+#error "R_UART_RTS_ROOM must be under half of R_UART_RX_RING_SIZE"
+#endif
+// End UART RECEPTION -------------------------------------------------------------------------------------------------
+
+// Start UART TRANSMISSION --------------------------------------------------------------------------------------------
+/** Responses sent with HAL_UART_Transmit(), the CPU waits for the last byte. */
+#define R_UART_TX_MODE_BLOCKING			0
+
+/** Responses queued and sent by the UART transmit interrupt. */
+#define R_UART_TX_MODE_IT						1
+
+/** Responses queued and sent by a DMA channel, one interrupt per transfer. */
+#define R_UART_TX_MODE_DMA					2
+
+/**
+ * @brief Selected UART transmission mode.
+ *
+ * With the queued modes r_uart_send() returns as soon as the response is
+ * copied into the transmission queue, and the update keeps assembling and
+ * programming pages while it drains.
+ */
+#define R_UART_TX_MODE							R_UART_TX_MODE_DMA
+
+/**
+ * @brief Size in bytes of the UART transmission queue.
+ *
+ * Holds the responses not sent yet. When it is full, r_uart_send() waits
+ * for room, as after the header of a page-diff update, which answers one
+ * PAGE_CRC per page at once.
+ */
+#define R_UART_TX_QUEUE_SIZE				512U
+// End UART TRANSMISSION ----------------------------------------------------------------------------------------------
+
+// Start UART BAUD RATE -----------------------------------------------------------------------------------------------
+/**
+ * @brief Accept ETX_OTA_CMD_SET_BAUD between the start command and the header.
+ *
+ * The UART comes up at the rate set by MX_USARTx_UART_Init(). The host may
+ * then propose a higher one: it is answered with ETX_OTA_RESP_BAUD at the
+ * current rate, and the UART switches right after. The host confirms with
+ * the same command at the new rate; without it, the previous rate comes
+ * back after R_OTA_BAUD_CONFIRM_MS.
+ */
+#define R_OTA_SET_BAUD							1
+
+/** Highest baud rate accepted, whatever the UART clock allows. */
+#define R_OTA_BAUD_MAX							2000000U
+
+/**
+ * @brief Largest baud rate error accepted, in thousandths.
+ *
+ * The rate reached is the UART clock divided by a whole BRR value (8x
+ * oversampling below 16x), so a rate is refused when it lands further
+ * than this from the one proposed.
+ */
+#define R_OTA_BAUD_ERROR_PERMILLE		20U
+
+/** Time in ms to receive the confirmation at the new rate before going back to the previous one. */
+#define R_OTA_BAUD_CONFIRM_MS				1000U
+// End UART BAUD RATE -------------------------------------------------------------------------------------------------
+
+// Start CLOCK PROFILE ------------------------------------------------------------------------------------------------
+/** The update runs on the clock set by SystemClock_Config() (MSI 4 MHz, range 2). */
+#define R_OTA_CLOCK_BOOT						0
+
+/** The update runs at 48 MHz from the PLL (range 1, two flash wait states), MSI locked on the LSE. */
+#define R_OTA_CLOCK_PLL_48MHZ				1
+
+/**
+ * @brief Clock profile selected when the start command opens an update.
+ *
+ * The switch happens before the start command is answered, so nothing is
+ * on the wire, and the UART keeps its baud rate on the new clock. The
+ * higher clock speeds up page assembly and the CRC, and lets
+ * ETX_OTA_CMD_SET_BAUD reach R_OTA_BAUD_MAX. r_go_to_app() puts the
+ * clocks back to their reset state either way.
+ */
+#define R_OTA_CLOCK_PROFILE					R_OTA_CLOCK_PLL_48MHZ
+// End CLOCK PROFILE --------------------------------------------------------------------------------------------------
+
+// Start PACKET SIZE --------------------------------------------------------------------------------------------------
+/**
+ * @brief Largest data size per packet the bootloader accepts.
+ *
+ * Must be a power of two up to FLASH_PAGE_SIZE. The packet buffers are
+ * sized from it, and a larger size requested in the header packet is
+ * clamped to it.
+ */
+#define R_OTA_PAYLOAD_MAX						2048U
+
+/**
+ * @brief Check the CRC of every data packet as it arrives.
+ *
+ * A corrupted packet is answered right away with a NACK (ETX_OTA_ERR_CRC),
+ * so it costs one packet instead of its whole page.
+ */
+#define R_OTA_PACKET_CRC						1
+
+/**
+ * @brief Accept data packets protected by Reed-Solomon parity (ETX_OTA_OPT_FEC).
+ *
+ * The host appends ETX_OTA_FEC_SIZE() parity bytes to the data of every
+ * data packet. A few wrong bytes per packet are corrected on arrival,
+ * without a NACK and a round trip; the packet CRC is then checked on the
+ * corrected data and still catches what the parity could not fix.
+ */
+#define R_OTA_FEC										1
+
+#if (R_OTA_FEC != 0) && (R_OTA_PACKET_CRC == 0)
+#error "R_OTA_FEC needs R_OTA_PACKET_CRC"
+#endif
+// End PACKET SIZE ----------------------------------------------------------------------------------------------------
+
+// Start TRANSFER WINDOW ----------------------------------------------------------------------------------------------
+/**
+ * @brief Maximum number of data packets the host may keep in flight.
+ *
+ * The window requested in the header packet is clamped to this value and
+ * to the number of packets the reception ring can hold. 0 disables the
+ * window mode and every update runs in stop-and-wait mode.
+ */
+#define R_OTA_WINDOW_MAX						8U
+
+/**
+ * @brief Accept selective retransmission (ETX_OTA_OPT_SELECTIVE in the header packet).
+ *
+ * Only in window mode and with up to ETX_OTA_SLOT_MAP_BITS data packets
+ * per page. Raw and fill packets go straight to their place in the page
+ * even after a gap, and the missing ones are asked for with
+ * ETX_OTA_RESP_NACK_MAP, so the host resends only those instead of
+ * everything after the gap.
+ */
+#define R_OTA_SELECTIVE							1
+
+/**
+ * @brief Accept erasure coded pages (ETX_OTA_OPT_CODED_MASK in the header packet).
+ *
+ * Only with selective retransmission granted. The host follows the data
+ * packets of a page with a few ETX_OTA_PACKET_TYPE_CODED packets, and the
+ * data packets lost (or corrupted) on the way are rebuilt from them in the
+ * page buffer instead of being asked for again. Meanwhile the ACK moves
+ * past the gaps, short of the last packet of the page. Only when
+ * more are lost than coded packets arrive does the page fall back to
+ * NACK_MAP. The reception ring keeps room for the coded packets of a
+ * page, so the window may be granted smaller.
+ */
+#define R_OTA_ERASURE								1
+
+#if (R_OTA_ERASURE != 0) && (R_OTA_SELECTIVE == 0)
+#error "R_OTA_ERASURE needs R_OTA_SELECTIVE"
+#endif
+// End TRANSFER WINDOW ------------------------------------------------------------------------------------------------
+
+// Start FLASH ERASE --------------------------------------------------------------------------------------------------
+/** The whole application region is erased when the header packet arrives. */
+#define R_OTA_ERASE_BANK						0
+
+/** Only the pages the announced image needs are erased when the header packet arrives. */
+#define R_OTA_ERASE_IMAGE						1
+
+/** Each page is erased right before it is programmed, while the reception keeps running. */
+#define R_OTA_ERASE_PAGE						2
+
+/**
+ * @brief Selected erase strategy.
+ *
+ * R_OTA_ERASE_PAGE answers the header packet immediately and spreads
+ * the erase time over the transfer.
+ */
+#define R_OTA_ERASE_MODE						R_OTA_ERASE_PAGE
+// End FLASH ERASE ----------------------------------------------------------------------------------------------------
+
+// Start FLASH PROGRAM ------------------------------------------------------------------------------------------------
+/** Pages programmed one double word at a time. */
+#define R_FLASH_PROGRAM_DOUBLEWORD				0
+
+/** Pages programmed by fast programming rows (32 double words), from RAM. */
+#define R_FLASH_PROGRAM_FAST						1
+
+/**
+ * @brief Selected flash programming mode.
+ *
+ * If a fast row fails, the page is erased again and written in double
+ * words, and fast programming stays disabled until the next reset.
+ */
+#define R_FLASH_PROGRAM_MODE						R_FLASH_PROGRAM_FAST
+
+/**
+ * @brief Measure the time of every page write with the DWT cycle counter.
+ *
+ * The result is kept in g_flash_page_timing (see r_flash_functions.h),
+ * readable from the debugger.
+ */
+#define R_FLASH_PAGE_TIMING							1
+
+/**
+ * @brief Skip programming the double words (or fast rows) left at 0xFF.
+ *
+ * The page is always erased before it is written, so they already read
+ * back as 0xFF. Padding and ETX_OTA_PACKET_TYPE_FILL runs of 0xFF then
+ * cost no programming time.
+ */
+#define R_FLASH_SKIP_ERASED							1
+// End FLASH PROGRAM --------------------------------------------------------------------------------------------------
+
+// Start RESUME / PAGE DIFF -------------------------------------------------------------------------------------------
+/**
+ * @brief Keep an update journal so an interrupted update can resume.
+ *
+ * Every page programmed and verified is recorded in the EEPROM emulation
+ * page. After a link loss or a reset, the host sends the same header and
+ * then ETX_OTA_CMD_RESUME, answered with ETX_OTA_RESP_RESUME: the image
+ * offset it must continue from.
+ */
+#define R_OTA_RESUME								1
+
+/**
+ * @brief Accept page-diff updates (ETX_OTA_OPT_PAGE_DIFF in the header packet).
+ *
+ * The header erases nothing and is followed by an ETX_OTA_RESP_PAGE_CRC
+ * for every page of the announced image, computed over the current
+ * application. The host then sends only the pages whose CRC differs, and
+ * the others are neither erased nor programmed.
+ */
+#define R_OTA_PAGE_DIFF							1
+// End RESUME / PAGE DIFF ---------------------------------------------------------------------------------------------
+
+// Start COMPRESSION / DELTA ------------------------------------------------------------------------------------------
+/**
+ * @brief Accept LZSS compressed pages (ETX_OTA_OPT_LZSS in the header packet).
+ *
+ * Only in window mode. Every page is compressed on its own and decoded
+ * straight into the page buffer, so no RAM is added; the bulk header CRC
+ * and the image CRC still cover the decompressed bytes.
+ */
+#define R_OTA_LZSS									1
+
+/**
+ * @brief Accept pages sent as a delta of the installed image (ETX_OTA_OPT_DELTA).
+ *
+ * Only in window mode and together with a page-diff update, whose page
+ * CRCs let the host check the installed image it builds the delta from.
+ * The image is rebuilt in place: a page only copies from the installed
+ * image at its own page or later.
+ */
+#define R_OTA_DELTA									1
+
+/**
+ * @brief Accept fill packets (ETX_OTA_OPT_FILL in the header packet).
+ *
+ * A run of a constant byte, such as 0xFF or 0x00 padding, is sent as its
+ * offset, length and byte instead of data, in stop-and-wait and window
+ * mode.
+ */
+#define R_OTA_FILL									1
+
+#if (R_OTA_DELTA != 0) && (R_OTA_PAGE_DIFF == 0)
+#error "R_OTA_DELTA needs R_OTA_PAGE_DIFF"
+#endif
+// End COMPRESSION / DELTA --------------------------------------------------------------------------------------------
+
+// Start CRC ----------------------------------------------------------------------------------------------------------
+/**
+ * @brief Feed the running image CRC from flash right after each page is programmed.
+ *
+ * With 1 every page is read back, so the CRC checked by the end command
+ * covers what really landed in flash. With 0 it is fed from the page
+ * buffer in RAM, which skips the read but trusts the programming.
+ */
+#define R_OTA_CRC_READBACK					1
+
+/** CRC computed in software with the precomputed table. */
+#define R_CRC_BACKEND_SW						0
+
+/** CRC computed by the CRC peripheral, fed word by word by the CPU. */
+#define R_CRC_BACKEND_HW						1
+
+/** CRC computed by the CRC peripheral, fed by a memory-to-memory DMA channel. */
+#define R_CRC_BACKEND_HW_DMA				2
+
+/**
+ * @brief Selected CRC backend.
+ *
+ * The hardware backends need MX_CRC_Init() to run first, and
+ * R_CRC_BACKEND_HW_DMA the DMA1 clock enabled by MX_DMA_Init().
+ */
+#define R_CRC_BACKEND								R_CRC_BACKEND_HW
+
+/** DMA channel used by R_CRC_BACKEND_HW_DMA (channels 1 and 2 receive the UARTs, 4 and 5 transmit). */
+#define R_CRC_DMA_CHANNEL						DMA1_Channel3
+// End CRC ------------------------------------------------------------------------------------------------------------
+
+#endif // R_OTA_CONFIG_H
@@ -34,16 +34,72 @@
 
 /** Packet type sector inside protocol */
 #define ETX_OTA_PACKET_TYPE_SECTOR	1	
-/** Data sector inside protocol when Datapack */
-#define ETX_OTA_DATA_SECTOR					4	
+/** Data sector inside protocol when Datapack (after the sequence number) */
+#define ETX_OTA_DATA_SECTOR					6	
 
-/** Maximum data size in an OTA packet */
+/** Size in bytes of the sequence number carried by data packets */
+#define ETX_OTA_DATA_SEQ_SIZE			2
+
+/** Data size in an OTA packet when the header does not negotiate one */
 #define ETX_OTA_DATA_MAX_SIZE			256
+/** Smallest data size that can be negotiated */
+#define ETX_OTA_DATA_MIN_SIZE			16
 /** Data overhead in bytes in an OTA packet */
-#define ETX_OTA_DATA_OVERHEAD			10 
-/** Maximum total packet size (data + overhead) */
+#define ETX_OTA_DATA_OVERHEAD			( 10 + ETX_OTA_DATA_SEQ_SIZE )
+/** Total packet size (data + overhead) with the default data size */
 #define ETX_OTA_PACKET_MAX_SIZE ( ETX_OTA_DATA_MAX_SIZE + ETX_OTA_DATA_OVERHEAD )
 
+/** meta_info.reserved2: number of data packets the host wants in flight (0 = stop-and-wait) */
+#define ETX_OTA_OPT_WINDOW_MASK		0x000000FFUL
+/** meta_info.reserved2: page-diff mode, only the pages that changed are sent */
+#define ETX_OTA_OPT_PAGE_DIFF			0x00000100UL
+/** meta_info.reserved2: pages may be sent LZSS compressed (ETX_OTA_PACKET_TYPE_DATA_LZ, window mode) */
+#define ETX_OTA_OPT_LZSS					0x00000200UL
+/** meta_info.reserved2: pages may be sent as a delta of the installed image (ETX_OTA_PACKET_TYPE_DATA_DELTA, with page-diff) */
+#define ETX_OTA_OPT_DELTA					0x00000400UL
+/** meta_info.reserved2: runs of a constant byte may be sent as ETX_OTA_PACKET_TYPE_FILL */
+#define ETX_OTA_OPT_FILL					0x00000800UL
+/** meta_info.reserved2: missing packets of a page are asked for one by one with NACK_MAP (window mode) */
+#define ETX_OTA_OPT_SELECTIVE			0x00001000UL
+
+/** meta_info.reserved2: data packets carry Reed-Solomon parity after their data (see ETX_OTA_FEC_SIZE) */
+#define ETX_OTA_OPT_FEC						0x00002000UL
+/** meta_info.reserved2: ETX_OTA_PACKET_TYPE_CODED packets that follow each page to rebuild lost ones (with selective, 0 = none) */
+#define ETX_OTA_OPT_CODED_MASK		0x000F0000UL
+/** meta_info.reserved2: first bit of ETX_OTA_OPT_CODED_MASK */
+#define ETX_OTA_OPT_CODED_SHIFT		16U
+
+/** Most data packets per page with selective retransmission: one bit each in NACK_MAP */
+#define ETX_OTA_SLOT_MAP_BITS			32U
+
+/** FEC: Reed-Solomon parity bytes per codeword, each codeword corrects half as many wrong bytes */
+#define ETX_OTA_FEC_PARITY				4U
+/** FEC: largest codeword (data + parity) */
+#define ETX_OTA_FEC_CODEWORD			255U
+/** FEC: parity bytes added to n data bytes, spread over interleaved codewords of up to ETX_OTA_FEC_CODEWORD bytes */
+#define ETX_OTA_FEC_SIZE(n)				( (((n) + (ETX_OTA_FEC_CODEWORD - ETX_OTA_FEC_PARITY) - 1U) / (ETX_OTA_FEC_CODEWORD - ETX_OTA_FEC_PARITY)) * ETX_OTA_FEC_PARITY )
+
+/** Erasure: most coded packets per page (Row below the number granted) */
+#define ETX_OTA_ERASURE_ROWS			8U
+/** Erasure: bytes of the Row field ahead of the coded data */
+#define ETX_OTA_CODED_ROW_SIZE		1U
+
+/** LZSS match token: bits of the distance - 1 (the rest holds the length) */
+#define ETX_OTA_LZ_DIST_BITS			11
+/** LZSS shortest match */
+#define ETX_OTA_LZ_MIN_MATCH			3
+
+/** Delta operation: kind in the 2 high bits of its first byte */
+#define ETX_OTA_DELTA_KIND_SHIFT	6
+/** Delta operation: length - 1 in the 6 low bits, this value means a 16-bit length follows */
+#define ETX_OTA_DELTA_LEN_EXT			0x3F
+/** Delta operation: literal bytes follow */
+#define ETX_OTA_DELTA_LITERAL			0
+/** Delta operation: copy from a 24-bit installed image offset that follows */
+#define ETX_OTA_DELTA_COPY				1
+/** Delta operation: copy from the installed image with the displacement of the last copy */
+#define ETX_OTA_DELTA_COPY_SAME		2
+
 //
 /**
  * Exception codes
@@ -77,8 +133,17 @@ typedef enum : uint8_t
   ETX_OTA_PACKET_TYPE_HEADER    		= 2,    // Header
 	ETX_OTA_PACKET_TYPE_BULK_HEADER   = 3,    // Header
   ETX_OTA_PACKET_TYPE_RESPONSE  		= 4,    // Response
+  ETX_OTA_PACKET_TYPE_DATA_LZ   		= 5,    // Data, LZSS compressed page
+  ETX_OTA_PACKET_TYPE_DATA_DELTA		= 6,    // Data, page as a delta of the installed image
+  ETX_OTA_PACKET_TYPE_FILL      		= 7,    // Run of a constant byte
+  ETX_OTA_PACKET_TYPE_CODED     		= 8,    // Combination of the data packets of a page
 }ETX_OTA_PACKET_TYPE_;
 
+/** Packet types numbered with a sequence number after Len */
+#define ETX_OTA_PACKET_HAS_SEQ(type)	(((type) == ETX_OTA_PACKET_TYPE_DATA) || ((type) == ETX_OTA_PACKET_TYPE_DATA_LZ) || \
+																			 ((type) == ETX_OTA_PACKET_TYPE_DATA_DELTA) || ((type) == ETX_OTA_PACKET_TYPE_FILL) || \
+																			 ((type) == ETX_OTA_PACKET_TYPE_CODED))
+
 /**
  * OTA Commands
  */
@@ -87,12 +152,51 @@ typedef enum : uint8_t
   ETX_OTA_CMD_START = 0,    // OTA Start command
   ETX_OTA_CMD_END   = 1,    // OTA End command
   ETX_OTA_CMD_ABORT = 2,    // OTA Abort command
+  ETX_OTA_CMD_RESUME = 3,   // OTA Resume command (after the header: where to continue)
+  ETX_OTA_CMD_SET_BAUD = 4, // Switch the UART baud rate (after START, see ETX_OTA_COMMAND_BAUD_)
 }ETX_OTA_CMD_;
 
+/**
+ * Response status (what Seq, Arg0 and Arg1 of ETX_OTA_RESP_ hold)
+ */
+typedef enum : uint8_t
+{
+  ETX_OTA_RESP_ACK        = ETX_OTA_ACK,    // Packet or page accepted (Seq: last packet confirmed, window mode)
+  ETX_OTA_RESP_NACK       = ETX_OTA_NACK,   // Rejected, see Error (Seq: packet to resend from, window mode)
+  ETX_OTA_RESP_HEADER_OK  = 2,              // Header accepted (Arg0: data size, Arg1: options and window granted)
+  ETX_OTA_RESP_BULK_OK    = 3,              // Bulk header accepted
+  ETX_OTA_RESP_DATA_OK    = 4,              // Data packet stored (stop-and-wait)
+  ETX_OTA_RESP_NACK_MAP   = 5,              // Seq: first packet of the page, Arg0: missing packets, one bit each
+  ETX_OTA_RESP_RESUME     = 6,              // Arg0: image offset to continue from
+  ETX_OTA_RESP_PAGE_CRC   = 7,              // Seq: page, Arg0: CRC of the installed page
+  ETX_OTA_RESP_BAUD       = 8,              // Arg0: baud rate switched to (sent at the previous rate, then confirmed at the new one)
+}ETX_OTA_RESP_STATUS_;
+
+/**
+ * Response error codes (why a NACK was sent)
+ */
+typedef enum : uint8_t
+{
+  ETX_OTA_ERR_NONE        = 0,    // No error
+  ETX_OTA_ERR_PACKET      = 1,    // Packet not expected in this state, or malformed
+  ETX_OTA_ERR_CRC         = 2,    // Packet CRC mismatch
+  ETX_OTA_ERR_SEQ         = 3,    // Packet out of sequence (window mode)
+  ETX_OTA_ERR_PAGE_CRC    = 4,    // Page CRC differs from its bulk header
+  ETX_OTA_ERR_FLASH       = 5,    // Page could not be erased or programmed
+  ETX_OTA_ERR_IMAGE_CRC   = 6,    // Image CRC differs from the header at the end command
+  ETX_OTA_ERR_BAUD        = 7,    // Baud rate not reachable from the UART clock, or not expected now
+  ETX_OTA_ERR_FRAME       = 8,    // Frame dropped: bad SOF, type, length or end of frame, or cut short
+}ETX_OTA_RESP_ERR_;
+
 //=================================================================================
 
 /**
  * OTA meta info
+ *
+ * reserved1 carries the data size per packet requested by the host
+ * (power of two up to FLASH_PAGE_SIZE, 0 for ETX_OTA_DATA_MAX_SIZE) and
+ * reserved2 the transfer options (see ETX_OTA_OPT_WINDOW_MASK and
+ * ETX_OTA_OPT_PAGE_DIFF).
  */
 #pragma pack(push, 1)
 typedef struct
@@ -126,6 +230,36 @@ typedef struct
 }__attribute__((packed)) ETX_OTA_COMMAND_;
 #pragma pack(pop)
 
+/**
+ * OTA Set baud rate command format
+ *
+ * A command packet with ETX_OTA_CMD_SET_BAUD and the proposed baud rate.
+ * Len is ETX_OTA_CMD_BAUD_DATA_SIZE and the CRC covers CMD and Baud, like
+ * the data of a data packet.
+ *
+ * ______________________________________________
+ * |     | Packet |     |     |      |     |     |
+ * | SOF | Type   | Len | CMD | Baud | CRC | EOF |
+ * |_____|________|_____|_____|______|_____|_____|
+ *   1B      1B     2B    1B     4B     4B    2B
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+  uint8_t   sof;
+  ETX_OTA_PACKET_TYPE_   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint32_t  baud;
+  uint32_t  crc;
+  uint8_t   saltoLinea;
+	uint8_t   finLinea;
+}__attribute__((packed)) ETX_OTA_COMMAND_BAUD_;
+#pragma pack(pop)
+
+/** Bytes of a set baud rate command covered by Len and by its CRC (CMD and Baud) */
+#define ETX_OTA_CMD_BAUD_DATA_SIZE		5U
+
 /**
  * OTA Header format
  *
@@ -170,14 +304,53 @@ typedef struct
 }__attribute__((packed)) ETX_OTA_BULK_HEADER_;
 #pragma pack(pop)
 
+/**
+ * OTA Bulk Header format with page index (page-diff mode)
+ *
+ * Page is the index of the page that follows and Skip the number of
+ * unchanged pages left out right before it. Page equal to the number of
+ * pages of the image, with no data after it, skips to the end.
+ *
+ * ________________________________________________________
+ * |     | Packet |     |  CRC   |      |      |     |     |
+ * | SOF | Type   | Len |  BULK  | Page | Skip | CRC | EOF |
+ * |_____|________|_____|________|______|______|_____|_____|
+ *   1B      1B     2B     4B      2B     2B     4B    2B
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+  uint8_t     sof;
+  ETX_OTA_PACKET_TYPE_     packet_type;
+  uint16_t    data_len;
+  uint32_t    bulk_crc;
+  uint16_t    page;
+  uint16_t    skip;
+  uint32_t    crc;
+  uint8_t   	saltoLinea;
+	uint8_t   	finLinea;
+}__attribute__((packed)) ETX_OTA_BULK_HEADER_PAGE_;
+#pragma pack(pop)
+
 /**
  * OTA Data format
  *
- * __________________________________________
- * |     | Packet |     |        |     |     |
- * | SOF | Type   | Len |  Data  | CRC | EOF |
- * |_____|________|_____|________|_____|_____|
- *   1B      1B     2B    nBytes   4B    1B
+ * Len counts only the Data bytes. Seq numbers the data packets of an
+ * update from 0 and is used to acknowledge them in window mode.
+ *
+ * With ETX_OTA_PACKET_TYPE_DATA_LZ, the packets of a page carry that page
+ * compressed on its own (see r_lzss.c). The first packet of page n is
+ * still numbered n * (FLASH_PAGE_SIZE / data size), and the numbers a
+ * shorter compressed page does not use are skipped.
+ *
+ * ETX_OTA_PACKET_TYPE_DATA_DELTA is numbered the same way, and carries the
+ * page as operations over the installed image (see r_delta.c).
+ *
+ * ________________________________________________
+ * |     | Packet |     |     |        |     |     |
+ * | SOF | Type   | Len | Seq |  Data  | CRC | EOF |
+ * |_____|________|_____|_____|________|_____|_____|
+ *   1B      1B     2B    2B    nBytes   4B    1B
  */
 #pragma pack(push, 1)
 typedef struct
@@ -185,20 +358,83 @@ typedef struct
   uint8_t     sof;
   ETX_OTA_PACKET_TYPE_     packet_type;
   uint16_t    data_len;
+  uint16_t    seq;
   //uint8_t     *data;
 	uint8_t data[ETX_OTA_DATA_MAX_SIZE];
 	uint32_t    crc;
 }__attribute__((packed)) ETX_OTA_DATA_;
 #pragma pack(pop)
 
+/**
+ * OTA Fill format
+ *
+ * Stands for Length bytes of Pattern at image offset Offset, where the
+ * page being assembled continues. Numbered like a data packet, it never
+ * crosses the end of a page.
+ *
+ * ______________________________________________________________________
+ * |     | Packet |     |     |        |        |         |     |     |
+ * | SOF | Type   | Len | Seq | Offset | Length | Pattern | CRC | EOF |
+ * |_____|________|_____|_____|________|________|_________|_____|_____|
+ *   1B      1B     2B    2B     4B       2B        1B      4B    1B
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+  uint8_t     sof;
+  ETX_OTA_PACKET_TYPE_     packet_type;
+  uint16_t    data_len;
+  uint16_t    seq;
+  uint32_t    offset;
+  uint16_t    length;
+  uint8_t     pattern;
+  uint32_t    crc;
+  uint8_t   	saltoLinea;
+	uint8_t   	finLinea;
+}__attribute__((packed)) ETX_OTA_FILL_;
+#pragma pack(pop)
+
+/**
+ * OTA Coded format
+ *
+ * Seq is the first sequence number of the page. The data is one data size
+ * long: data packet k of the page (padded with 0xFF up to the data size)
+ * times 1 / ((ETX_OTA_SLOT_MAP_BITS + Row) ^ k) in GF(256), added over
+ * every k of the page (a Cauchy matrix, see r_fec.c). Len counts Row and
+ * the data. Any n coded packets with different Row rebuild n lost data
+ * packets of the page.
+ *
+ * ____________________________________________________
+ * |     | Packet |     |     |     |        |     |     |
+ * | SOF | Type   | Len | Seq | Row |  Data  | CRC | EOF |
+ * |_____|________|_____|_____|_____|________|_____|_____|
+ *   1B      1B     2B    2B    1B    nBytes   4B    2B
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+  uint8_t     sof;
+  ETX_OTA_PACKET_TYPE_     packet_type;
+  uint16_t    data_len;
+  uint16_t    seq;
+  uint8_t     row;
+  uint8_t     data[ETX_OTA_DATA_MAX_SIZE];
+}__attribute__((packed)) ETX_OTA_CODED_;
+#pragma pack(pop)
+
 /**
  * OTA Response format
  *
- * __________________________________________
- * |     | Packet |     |        |     |     |
- * | SOF | Type   | Len | Status | CRC | EOF |
- * |_____|________|_____|________|_____|_____|
- *   1B      1B     2B      1B     4B    2B
+ * Every answer of the bootloader, always the same size. Len is
+ * ETX_OTA_RESP_DATA_SIZE and the CRC covers Status to Arg1, like the data
+ * of a data packet. Seq, Arg0 and Arg1 depend on the status (see
+ * ETX_OTA_RESP_STATUS_) and are 0 when unused.
+ *
+ * ___________________________________________________________________
+ * |     | Packet |     |        |       |     |      |      |     |     |
+ * | SOF | Type   | Len | Status | Error | Seq | Arg0 | Arg1 | CRC | EOF |
+ * |_____|________|_____|________|_______|_____|______|______|_____|_____|
+ *   1B      1B     2B      1B       1B     2B    4B     4B     4B    2B
  */
 #pragma pack(push, 1)
 typedef struct
@@ -206,11 +442,18 @@ typedef struct
   uint8_t   sof;
   ETX_OTA_PACKET_TYPE_   packet_type;
   uint16_t  data_len;
-  uint8_t   status;
+  ETX_OTA_RESP_STATUS_   status;
+  ETX_OTA_RESP_ERR_      error;
+  uint16_t  seq;
+  uint32_t  arg0;
+  uint32_t  arg1;
   uint32_t  crc;
   uint8_t   saltoLinea;
 	uint8_t   finLinea;
 }__attribute__((packed)) ETX_OTA_RESP_;
 #pragma pack(pop)
 
+/** Bytes of a response covered by Len and by its CRC (Status to Arg1) */
+#define ETX_OTA_RESP_DATA_SIZE		12U
+
 #endif /* R_OTA_STRUCTURE_H */
\ No newline at end of file
@@ -3,11 +3,55 @@ import struct
 import time
 import zlib
 import binascii
+import bisect
+import os
+from collections import namedtuple
 
 # === CONFIGURACIÓN ===
 PORT = "COM4"         # Puerto serie de tu placa
 #BAUDRATE = 57600
 BAUDRATE = 115200
+# Velocidades a proponer al micro despues del START, de mayor a menor: se queda con la
+# primera que acepta (la que su reloj alcanza) y confirma. Vacio = seguir en BAUDRATE
+BAUD_RATES = [2000000, 921600, 460800, 230400]
+# Segundos que el micro espera la confirmacion a la nueva velocidad (R_OTA_BAUD_CONFIRM_MS)
+BAUD_CONFIRM_TIMEOUT = 1.0
+# Control de flujo por hardware (RTS/CTS, R_UART_FLOW_CONTROL en el micro): el micro frena
+# al host cuando no puede recibir mas y se mandan los paquetes sin las pausas fijas
+RTSCTS = False
+
+# Paquetes DATA en vuelo sin esperar confirmacion (0 = stop-and-wait).
+# El bootloader responde en HEADER_OK la ventana que acepta.
+WINDOW_SIZE = 8
+# Segundos sin ACK/NACK antes de reenviar desde el ultimo paquete confirmado
+WINDOW_TIMEOUT = 1.0
+# Bytes de datos por paquete pedidos al micro (potencia de 2, hasta PAGE_SIZE).
+# El bootloader responde en HEADER_OK el tamanio que acepta.
+PAYLOAD_SIZE = 2048
+# Pedir al bootloader que continue una actualizacion interrumpida (misma imagen):
+# responde "RESUME <offset>" con el offset desde el que hay que seguir enviando.
+RESUME = True
+# Actualizacion diferencial: el micro manda el CRC de cada pagina de la App actual
+# y solo se envian (y se borran) las paginas que cambiaron.
+PAGE_DIFF = True
+# Paginas comprimidas con LZSS (solo con ventana): cada pagina se comprime por
+# separado y se manda comprimida solo si ocupa menos que la original.
+LZSS = True
+# Actualizacion delta (con PAGE_DIFF y ventana): imagen instalada hoy en el micro.
+# Cada pagina se puede mandar como copias de esa imagen mas los bytes nuevos.
+# Con None, o si el archivo no existe, no se usa.
+DELTA_BASE = "firmware_old.bin"
+# Tramos de un mismo byte (relleno 0xFF/0x00) enviados como FILL (offset, largo, byte)
+FILL = True
+# Retransmision selectiva (con ventana): el micro guarda los paquetes que llegan
+# despues de un hueco y pide con "NACK_MAP" solo los que faltan de la pagina
+SELECTIVE = True
+# Paridad Reed-Solomon en cada paquete DATA: el micro corrige unos pocos bytes
+# erroneos por paquete sin pedir reenvio (lineas serie ruidosas)
+FEC = True
+# Paquetes codificados por pagina (con SELECTIVE), para enlaces que pierden paquetes:
+# el micro reconstruye hasta ese numero de paquetes perdidos de la pagina sin pedir reenvio (0 = no)
+ERASURE = 0
 
 ETX_OTA_SOF  	    =   '$'
 ETX_OTA_SALTO_LINEA =	0x0D
@@ -21,9 +65,10 @@ ETX_OTA_DATA_SECTOR		   =	4
 
 #CAMBIE EL TAMANIO DE LOS PAQUETES. FIJARME EN LA APP EL TAMANIO DE DATA
 #DE PAQUETES
+#Tamanio por defecto, se reemplaza por el negociado en el HEADER
 ETX_OTA_DATA_MAX_SIZE = 256
 
-ETX_OTA_DATA_OVERHEAD = 10
+ETX_OTA_DATA_OVERHEAD = 12
 
 ETX_OTA_PACKET_MAX_SIZE = ( ETX_OTA_DATA_MAX_SIZE + ETX_OTA_DATA_OVERHEAD )
 
@@ -32,12 +77,66 @@ ETX_OTA_PACKET_TYPE_DATA      		= 1
 ETX_OTA_PACKET_TYPE_HEADER    		= 2 
 ETX_OTA_PACKET_TYPE_BULK_HEADER     = 3 
 ETX_OTA_PACKET_TYPE_RESPONSE  		= 4 
+ETX_OTA_PACKET_TYPE_DATA_LZ   		= 5 
+ETX_OTA_PACKET_TYPE_DATA_DELTA		= 6 
+ETX_OTA_PACKET_TYPE_FILL      		= 7 
+ETX_OTA_PACKET_TYPE_CODED     		= 8 
 
 ETX_OTA_CMD_START = 0
 ETX_OTA_CMD_END   = 1
+ETX_OTA_CMD_RESUME = 3
+ETX_OTA_CMD_SET_BAUD = 4
+
+# Respuestas del micro (ETX_OTA_RESP_): todas del mismo tamanio
+ETX_OTA_RESP_ACK       = 0
+ETX_OTA_RESP_NACK      = 1
+ETX_OTA_RESP_HEADER_OK = 2
+ETX_OTA_RESP_BULK_OK   = 3
+ETX_OTA_RESP_DATA_OK   = 4
+ETX_OTA_RESP_NACK_MAP  = 5
+ETX_OTA_RESP_RESUME    = 6
+ETX_OTA_RESP_PAGE_CRC  = 7
+ETX_OTA_RESP_BAUD      = 8
+ETX_OTA_RESP_DATA_SIZE = 12     # Status, Error, Seq, Arg0, Arg1 (los que cubre el CRC)
+ETX_OTA_RESP_SIZE      = 4 + ETX_OTA_RESP_DATA_SIZE + 4 + 2
+
+# Motivo de un NACK (Error de la respuesta)
+ETX_OTA_ERR_NAMES = ["sin error", "paquete inesperado", "CRC de paquete", "fuera de secuencia",
+                     "CRC de pagina", "error de flash", "CRC de imagen", "velocidad no disponible",
+                     "marco descartado"]
+
+ETX_OTA_OPT_PAGE_DIFF = 0x100
+ETX_OTA_OPT_LZSS      = 0x200
+ETX_OTA_OPT_DELTA     = 0x400
+ETX_OTA_OPT_FILL      = 0x800
+ETX_OTA_OPT_SELECTIVE = 0x1000
+ETX_OTA_OPT_FEC       = 0x2000
+ETX_OTA_OPT_CODED_SHIFT = 16     # paquetes codificados por pagina (4 bits)
+
+# Retransmision selectiva: lugares por pagina. Paquetes codificados: filas posibles
+ETX_OTA_SLOT_MAP_BITS = 32
+ETX_OTA_ERASURE_ROWS  = 8
+
+# FEC: bytes de paridad por palabra Reed-Solomon (corrige la mitad) y largo maximo de palabra
+ETX_OTA_FEC_PARITY    = 4
+ETX_OTA_FEC_CODEWORD  = 255
+
+# Formato LZSS: match de 2 bytes = (distancia - 1) | ((largo - 3) << 11)
+ETX_OTA_LZ_DIST_BITS  = 11
+ETX_OTA_LZ_MIN_MATCH  = 3
+ETX_OTA_LZ_MAX_MATCH  = ETX_OTA_LZ_MIN_MATCH + (1 << (16 - ETX_OTA_LZ_DIST_BITS)) - 1
+ETX_OTA_LZ_MAX_DIST   = 1 << ETX_OTA_LZ_DIST_BITS
+
+# Formato delta: primer byte = tipo (2 bits altos) | largo - 1 (6 bits bajos, 0x3F = largo de 2 bytes a continuacion)
+ETX_OTA_DELTA_LEN_EXT   = 0x3F
+ETX_OTA_DELTA_LITERAL   = 0     # siguen los bytes
+ETX_OTA_DELTA_COPY      = 1     # sigue el offset (3 bytes) en la imagen instalada
+ETX_OTA_DELTA_COPY_SAME = 2     # copia con el mismo desplazamiento que la copia anterior
+ETX_OTA_DELTA_KEY       = 4     # bytes del prefijo para buscar copias
+ETX_OTA_DELTA_MIN_COPY  = 8     # copia mas corta que vale la pena con offset
 
 PAGE_SIZE = 2048
-PACKETS_PER_PAGE = PAGE_SIZE/ETX_OTA_DATA_MAX_SIZE
+PACKETS_PER_PAGE = PAGE_SIZE//ETX_OTA_DATA_MAX_SIZE
 
 crc_table = [
 		0x00000000, 0x04C11DB7,  0x09823B6E, 0x0D4326D9,   0x130476DC, 0x17C56B6B,  0x1A864DB2, 0x1E475005,
@@ -142,22 +241,10 @@ def calculate_crc_word(data_word: bytes) -> int:
 
 def calculate_crc_word_datapack(data_word: bytes) -> int:
     """
-    Calcula el CRC de un uint32_t como calculateCRC en C.
-    data_word: entero de 32 bits.
+    Calcula el CRC de los datos de un paquete DATA (solo los len(data_word)
+    bytes que lleva), como r_calculate_word_crc_datapack en C.
     """
-    crc = 0xFFFFFFFF
-
-    for i in range(0, ETX_OTA_DATA_MAX_SIZE, 4):
-        # Convertir 4 bytes a uint32_t big-endian
-        word = int.from_bytes(data_word[i:i+4], byteorder='big') & 0xFFFFFFFF
-        val = word
-        for _ in range(4):
-            byte = (val >> 24) & 0xFF
-            table_index = ((crc >> 24) ^ byte) & 0xFF
-            crc = ((crc << 8) & 0xFFFFFFFF) ^ crc_table[table_index]
-            val = (val << 8) & 0xFFFFFFFF
-
-    return crc & 0xFFFFFFFF
+    return calculate_flash_crc(data_word)
 
 def calculate_crc_command(command_byte: int) -> int:
     """
@@ -186,6 +273,64 @@ def calculate_crc_page(page):
             crc ^= calculate_crc_word(block)
     return crc & 0xFFFFFFFF
 
+# Tablas de GF(256) (polinomio 0x11D) para la paridad Reed-Solomon, como r_fec.c
+GF_EXP = [0] * 510
+GF_LOG = [0] * 256
+_x = 1
+for _i in range(255):
+    GF_EXP[_i] = GF_EXP[_i + 255] = _x
+    GF_LOG[_x] = _i
+    _x <<= 1
+    if _x & 0x100:
+        _x ^= 0x11D
+
+def gf_mul(a, b):
+    return 0 if a == 0 or b == 0 else GF_EXP[GF_LOG[a] + GF_LOG[b]]
+
+def gf_inv(a):
+    return GF_EXP[255 - GF_LOG[a]]
+
+gf_mul_tables = {}
+def gf_mul_table(coef):
+    """Tabla para bytes.translate: cada byte multiplicado por 'coef'"""
+    if coef not in gf_mul_tables:
+        gf_mul_tables[coef] = bytes(gf_mul(coef, v) for v in range(256))
+    return gf_mul_tables[coef]
+
+def fec_generator():
+    """Polinomio generador con raices alfa^0 .. alfa^(paridad - 1), grado mayor primero"""
+    gen = [1]
+    for i in range(ETX_OTA_FEC_PARITY):
+        nxt = [0] * (len(gen) + 1)
+        for j, c in enumerate(gen):
+            nxt[j] ^= c
+            nxt[j + 1] ^= gf_mul(c, GF_EXP[i])
+        gen = nxt
+    return gen
+
+FEC_GENERATOR = fec_generator()
+
+def fec_encode(data):
+    """
+    Agrega la paridad Reed-Solomon despues de los datos. Los datos se reparten
+    en palabras intercaladas (el byte j va a la palabra j % palabras), asi una
+    rafaga de errores se divide entre todas; el byte de paridad m de la palabra
+    i va en m * palabras + i.
+    """
+    words = (len(data) + ETX_OTA_FEC_CODEWORD - ETX_OTA_FEC_PARITY - 1) // (ETX_OTA_FEC_CODEWORD - ETX_OTA_FEC_PARITY)
+    parity = bytearray(words * ETX_OTA_FEC_PARITY)
+    for i in range(words):
+        rem = [0] * ETX_OTA_FEC_PARITY
+        for b in data[i::words]:
+            f = b ^ rem[0]
+            rem = rem[1:] + [0]
+            if f:
+                for j in range(ETX_OTA_FEC_PARITY):
+                    rem[j] ^= gf_mul(FEC_GENERATOR[j + 1], f)
+        for m in range(ETX_OTA_FEC_PARITY):
+            parity[m * words + i] = rem[m]
+    return bytes(data) + bytes(parity)
+
 def hex_dump(packet_type, length, data, bytes_per_line=16):
     for i in range(0, len(data), bytes_per_line):
         chunk = data[i:i+bytes_per_line]
@@ -194,12 +339,18 @@ def hex_dump(packet_type, length, data, bytes_per_line=16):
         print(f"{i:08X} {ETX_OTA_SOF} {packet_type} {length:02X} {hex_bytes:<48} ")
 
 # Función para crear paquetes
-def make_packet_header(firmware):
+def make_packet_header(firmware, window=0, payload=0, diff=False, lz=False, delta=False, fill=False, selective=False, fec=False, erasure=0):
     hdata = struct.pack("<I I I I",
                     len(firmware),               # tamaño firmware
                     calculate_flash_crc(firmware),# CRC firmware
-                    0x00000000,             # campo reservado 1
-                    0x00000000)             # campo reservado 2
+                    payload,                # tamaño de datos por paquete pedido
+                    (window & 0xFF) | (ETX_OTA_OPT_PAGE_DIFF if diff else 0)
+                    | (ETX_OTA_OPT_LZSS if lz else 0)
+                    | (ETX_OTA_OPT_DELTA if delta else 0)
+                    | (ETX_OTA_OPT_FILL if fill else 0)
+                    | (ETX_OTA_OPT_SELECTIVE if selective else 0)
+                    | (ETX_OTA_OPT_FEC if fec else 0)
+                    | ((erasure & 0xF) << ETX_OTA_OPT_CODED_SHIFT))  # opciones: ventana pedida, diferencial, LZSS, delta, FILL, selectiva, FEC, codificados
     packet_type = ETX_OTA_PACKET_TYPE_HEADER
     length = len(hdata)
     crc = calculate_crc_word(hdata)
@@ -216,7 +367,11 @@ def make_packet_header(firmware):
     
     return packet
 
-def make_packet_bulk_header(bulk):
+def make_packet_bulk_header(bulk, page=None, skip=0):
+    """
+    Con 'page' (modo diferencial) el BULK_HEADER lleva tambien el indice de la
+    pagina y cuantas paginas sin cambios se saltean justo antes de ella.
+    """
     packet_type = ETX_OTA_PACKET_TYPE_BULK_HEADER
 
     # Calcular CRC del bulk (entero de 4 bytes)
@@ -225,9 +380,12 @@ def make_packet_bulk_header(bulk):
     # Convertir a bytes para pasarlo al CRC de palabra
     crc_bulk_bytes = struct.pack("<I", crc_bulk)  # 4 bytes, little-endian
 
-    length = 4
+    if page is not None:
+        crc_bulk_bytes += struct.pack("<H H", page, skip)
 
-    # Calcular CRC sobre esos 4 bytes
+    length = len(crc_bulk_bytes)
+
+    # Calcular CRC sobre esos bytes
     crc = calculate_crc_word(crc_bulk_bytes)
 
     # Construir paquete
@@ -238,14 +396,20 @@ def make_packet_bulk_header(bulk):
 
     return packet
 
-def make_packet_data(chunk, crc, length):
-    packet_type = ETX_OTA_PACKET_TYPE_DATA
-
+def make_packet_data(chunk, crc, length, seq, packet_type=ETX_OTA_PACKET_TYPE_DATA, fec=False):
+    """
+    Con 'fec' la paridad va despues de los datos y cuenta en el largo;
+    el CRC sigue siendo el de los datos solos.
+    """
+    if fec:
+        chunk = fec_encode(chunk)
+        length = len(chunk)
     packet = struct.pack(
-        "<c B H",                # SOF, TYPE, LENGTH
+        "<c B H H",              # SOF, TYPE, LENGTH, SEQ
         ETX_OTA_SOF.encode(),
         packet_type,
-        length
+        length,
+        seq & 0xFFFF
     )
     packet += chunk    
     packet += struct.pack("<I", crc)  # CRC 4 bytes LE
@@ -270,16 +434,429 @@ def make_packet_cmd(cmd):
     
     return packet
 
+def pause(seconds):
+    """Pausa fija para no adelantarse al micro; con RTSCTS el micro frena solo al host."""
+    if not RTSCTS:
+        time.sleep(seconds)
+
+def make_packet_set_baud(baud):
+    # CMD y velocidad, con el CRC de los dos como los datos de un paquete DATA
+    data = struct.pack("<BI", ETX_OTA_CMD_SET_BAUD, baud)
+    packet = struct.pack("<c B H", ETX_OTA_SOF.encode(), ETX_OTA_PACKET_TYPE_CMD, len(data))
+    packet += data
+    packet += struct.pack("<I", calculate_crc_word_datapack(data))
+    packet += struct.pack("BB", ETX_OTA_SALTO_LINEA, ETX_OTA_FIN_LINEA)
+    return packet
+
+Response = namedtuple("Response", "status error seq arg0 arg1")
+
+# Bytes recibidos que todavia no forman una respuesta completa
+rx_pending = bytearray()
+
+def read_response(ser):
+    """
+    Lee la proxima respuesta del micro (ETX_OTA_RESP_), o None si no llega una
+    completa antes del timeout del puerto. Descarta los bytes que no forman una
+    respuesta valida (SOF, tipo, Len, CRC y fin de linea).
+    """
+    while True:
+        start = rx_pending.find(ETX_OTA_SOF.encode())
+        del rx_pending[:start if start >= 0 else len(rx_pending)]
+        if len(rx_pending) >= ETX_OTA_RESP_SIZE:
+            frame = bytes(rx_pending[:ETX_OTA_RESP_SIZE])
+            packet_type, length = struct.unpack_from("<BH", frame, 1)
+            data = frame[4:4 + ETX_OTA_RESP_DATA_SIZE]
+            crc, cr, lf = struct.unpack_from("<IBB", frame, 4 + ETX_OTA_RESP_DATA_SIZE)
+            if (packet_type == ETX_OTA_PACKET_TYPE_RESPONSE and length == ETX_OTA_RESP_DATA_SIZE and
+                    cr == ETX_OTA_SALTO_LINEA and lf == ETX_OTA_FIN_LINEA and calculate_crc_word_datapack(data) == crc):
+                del rx_pending[:ETX_OTA_RESP_SIZE]
+                return Response(*struct.unpack("<BBHII", data))
+            del rx_pending[:1]
+            continue
+        chunk = ser.read(ETX_OTA_RESP_SIZE - len(rx_pending))
+        if not chunk:
+            return None
+        rx_pending.extend(chunk)
+
+def error_name(resp):
+    return ETX_OTA_ERR_NAMES[resp.error] if resp.error < len(ETX_OTA_ERR_NAMES) else f"error {resp.error}"
+
+def wait_baud_response(ser):
+    """Espera la respuesta a un SET_BAUD: BAUD, NACK o None si no llega nada."""
+    while True:
+        resp = read_response(ser)
+        if resp is None or resp.status in (ETX_OTA_RESP_BAUD, ETX_OTA_RESP_NACK):
+            return resp
+
+def set_baud(ser, rates):
+    """
+    Propone al micro las velocidades de rates, de mayor a menor. Con la primera que
+    acepta (BAUD, todavia a la velocidad actual) cambia el puerto y la confirma con el
+    mismo comando; si la confirmacion no vuelve, el micro regresa solo a la anterior
+    y se prueba la siguiente. Devuelve la velocidad con la que queda el enlace.
+    """
+    for baud in rates:
+        if baud <= ser.baudrate:
+            continue
+        ser.write(make_packet_set_baud(baud))
+        resp = wait_baud_response(ser)
+        if resp is None or resp.status != ETX_OTA_RESP_BAUD:
+            print(f"{baud} baudios: {error_name(resp) if resp else 'sin respuesta'}")
+            continue
+
+        previous = ser.baudrate
+        ser.flush()
+        try:
+            ser.baudrate = baud
+            ser.reset_input_buffer()
+            rx_pending.clear()
+            ser.write(make_packet_set_baud(baud))
+            resp = wait_baud_response(ser)
+        except (ValueError, serial.SerialException):
+            resp = None     # el adaptador USB-serie no llega a esa velocidad
+        if resp is not None and resp.status == ETX_OTA_RESP_BAUD:
+            return baud
+
+        # Sin confirmacion: esperar a que el micro vuelva a la velocidad anterior
+        print(f"{baud} baudios: sin confirmacion, vuelvo a {previous}")
+        ser.baudrate = previous
+        time.sleep(BAUD_CONFIRM_TIMEOUT)
+        ser.reset_input_buffer()
+        rx_pending.clear()
+    return ser.baudrate
+
+def lzss_compress(data):
+    """
+    Comprime una pagina con el formato que decodifica r_lzss_decode():
+    un byte de flags por cada 8 items (LSB primero, 1 = literal, 0 = match).
+    """
+    out = bytearray()
+    heads = {}          # prefijo de 3 bytes -> posiciones anteriores
+    flags_pos = 0
+    n_items = 8
+    pos = 0
+    while pos < len(data):
+        if n_items == 8:
+            flags_pos = len(out)
+            out.append(0)
+            n_items = 0
+
+        best_len = 0
+        best_dist = 0
+        key = data[pos:pos+ETX_OTA_LZ_MIN_MATCH]
+        if len(key) == ETX_OTA_LZ_MIN_MATCH:
+            for cand in reversed(heads.get(key, [])):
+                dist = pos - cand
+                if dist > ETX_OTA_LZ_MAX_DIST:
+                    break
+                length = 0
+                while (length < ETX_OTA_LZ_MAX_MATCH and pos + length < len(data)
+                       and data[cand + length] == data[pos + length]):
+                    length += 1
+                if length > best_len:
+                    best_len, best_dist = length, dist
+                    if length == ETX_OTA_LZ_MAX_MATCH:
+                        break
+
+        if best_len >= ETX_OTA_LZ_MIN_MATCH:
+            out += struct.pack("<H", (best_dist - 1) | ((best_len - ETX_OTA_LZ_MIN_MATCH) << ETX_OTA_LZ_DIST_BITS))
+            step = best_len
+        else:
+            out[flags_pos] |= 1 << n_items
+            out.append(data[pos])
+            step = 1
+
+        for p in range(pos, pos + step):
+            heads.setdefault(data[p:p+ETX_OTA_LZ_MIN_MATCH], []).append(p)
+        pos += step
+        n_items += 1
+    return bytes(out)
+
+class DeltaBase:
+    """
+    Imagen instalada en el micro, paginas verificadas contra sus PAGE_CRC
+    e indice de prefijos para buscar copias.
+    """
+    def __init__(self, old, n_pages, device_crcs, size):
+        self.old = old[:n_pages*PAGE_SIZE] + b"\xff" * max(0, n_pages*PAGE_SIZE - len(old))
+        # Fin de la zona verificada que empieza en cada pagina
+        self.valid_end = [0] * (n_pages + 1)
+        for page in reversed(range(n_pages)):
+            length = min(PAGE_SIZE, size - page*PAGE_SIZE)
+            if device_crcs.get(page) == calculate_flash_crc(self.old[page*PAGE_SIZE:page*PAGE_SIZE+length]):
+                self.valid_end[page] = self.valid_end[page+1] or (page+1)*PAGE_SIZE
+        self.index = {}
+        for o in range(0, len(self.old) - ETX_OTA_DELTA_KEY + 1):
+            self.index.setdefault(self.old[o:o+ETX_OTA_DELTA_KEY], []).append(o)
+
+    def match(self, o, data, i, first):
+        """Bytes de data[i:] iguales a la imagen instalada en o (solo desde la pagina 'first')."""
+        if o < first * PAGE_SIZE or o >= len(self.old) or not self.valid_end[o // PAGE_SIZE]:
+            return 0
+        limit = min(len(data) - i, self.valid_end[o // PAGE_SIZE] - o)
+        n = 0
+        while n < limit and self.old[o + n] == data[i + n]:
+            n += 1
+        return n
+
+def delta_op(kind, length, arg=b""):
+    if length < ETX_OTA_DELTA_LEN_EXT:
+        return bytes([(kind << 6) | (length - 1)]) + arg
+    return bytes([(kind << 6) | ETX_OTA_DELTA_LEN_EXT]) + struct.pack("<H", length) + arg
+
+def delta_encode(firmware, page, base):
+    """
+    Codifica una pagina como copias de la imagen instalada (desde esta misma
+    pagina, las anteriores ya pueden estar sobrescritas) y bytes literales.
+    """
+    data = firmware[page*PAGE_SIZE:(page+1)*PAGE_SIZE]
+    out = bytearray()
+    literal = bytearray()
+    shift = 0
+    i = 0
+    while i < len(data):
+        new_offset = page*PAGE_SIZE + i
+        kind, length = ETX_OTA_DELTA_COPY_SAME, base.match(new_offset + shift, data, i, page)
+        offset = 0
+        if length < ETX_OTA_DELTA_MIN_COPY:
+            for cand in reversed(base.index.get(data[i:i+ETX_OTA_DELTA_KEY], [])[-64:]):
+                n = base.match(cand, data, i, page)
+                if n >= ETX_OTA_DELTA_MIN_COPY and n > length + 4:
+                    kind, length, offset = ETX_OTA_DELTA_COPY, n, cand
+
+        if (kind == ETX_OTA_DELTA_COPY_SAME and length >= 2) or kind == ETX_OTA_DELTA_COPY:
+            if literal:
+                out += delta_op(ETX_OTA_DELTA_LITERAL, len(literal), bytes(literal))
+                literal = bytearray()
+            if kind == ETX_OTA_DELTA_COPY:
+                out += delta_op(kind, length, struct.pack("<I", offset)[:3])
+                shift = offset - new_offset
+            else:
+                out += delta_op(kind, length)
+            i += length
+        else:
+            literal.append(data[i])
+            i += 1
+    if literal:
+        out += delta_op(ETX_OTA_DELTA_LITERAL, len(literal), bytes(literal))
+    return bytes(out)
+
+def make_fill(offset, length, pattern):
+    return struct.pack("<I H B", offset, length, pattern)
+
+def is_fill(chunk):
+    return len(chunk) > 0 and chunk.count(chunk[0]) == len(chunk)
+
+def raw_packets(firmware, page, fill):
+    """
+    Paquetes (lugar, tipo, datos) de una pagina sin comprimir, con el lugar de
+    cada uno en la pagina. Con 'fill' los paquetes de un mismo byte van como FILL,
+    y los seguidos del mismo byte en uno solo.
+    """
+    raw = firmware[page*PAGE_SIZE:(page+1)*PAGE_SIZE]
+    packets = []
+    run = None      # [offset, largo, byte] del FILL en curso
+    for i in range(0, len(raw), ETX_OTA_DATA_MAX_SIZE):
+        chunk = raw[i:i+ETX_OTA_DATA_MAX_SIZE]
+        if fill and is_fill(chunk):
+            if run and run[2] == chunk[0]:
+                run[1] += len(chunk)
+                continue
+            run = [page*PAGE_SIZE + i, len(chunk), chunk[0]]
+            packets.append(run)
+        else:
+            run = None
+            packets.append((i // ETX_OTA_DATA_MAX_SIZE, ETX_OTA_PACKET_TYPE_DATA, chunk))
+    return [((p[0] % PAGE_SIZE) // ETX_OTA_DATA_MAX_SIZE, ETX_OTA_PACKET_TYPE_FILL, make_fill(*p))
+            if isinstance(p, list) else p for p in packets]
+
+def page_packets(firmware, page, lz, delta=None, fill=False):
+    """
+    Paquetes (lugar, tipo, datos) de una pagina: comprimida o como delta si asi ocupa menos.
+    El primer paquete de la pagina siempre lleva la secuencia page * PACKETS_PER_PAGE.
+    """
+    packets = raw_packets(firmware, page, fill)
+    size = sum(len(chunk) for _, _, chunk in packets)
+    raw = firmware[page*PAGE_SIZE:(page+1)*PAGE_SIZE]
+    if lz:
+        packed = lzss_compress(raw)
+        if len(packed) < size:
+            size, packets = len(packed), split_packets(ETX_OTA_PACKET_TYPE_DATA_LZ, packed)
+    if delta is not None:
+        patch = delta_encode(firmware, page, delta)
+        if len(patch) < size:
+            size, packets = len(patch), split_packets(ETX_OTA_PACKET_TYPE_DATA_DELTA, patch)
+    return packets
+
+def coded_packets(firmware, page, count):
+    """
+    Paquetes codificados de una pagina sin comprimir: los datos del paquete 'fila'
+    suman en GF(256) cada paquete k de la pagina (completado con 0xFF) por
+    1 / ((ETX_OTA_SLOT_MAP_BITS + fila) ^ k). Con 'count' de ellos el micro
+    reconstruye hasta 'count' paquetes perdidos de la pagina.
+    """
+    raw = firmware[page*PAGE_SIZE:(page+1)*PAGE_SIZE]
+    frags = [raw[i:i+ETX_OTA_DATA_MAX_SIZE].ljust(ETX_OTA_DATA_MAX_SIZE, b"\xff")
+             for i in range(0, len(raw), ETX_OTA_DATA_MAX_SIZE)]
+    packets = []
+    for row in range(count):
+        acc = 0
+        for k, frag in enumerate(frags):
+            coef = gf_inv((ETX_OTA_SLOT_MAP_BITS + row) ^ k)
+            acc ^= int.from_bytes(frag.translate(gf_mul_table(coef)), "big")
+        packets.append(bytes([row]) + acc.to_bytes(ETX_OTA_DATA_MAX_SIZE, "big"))
+    return packets
+
+def split_packets(packet_type, data):
+    return [(i // ETX_OTA_DATA_MAX_SIZE, packet_type, data[i:i+ETX_OTA_DATA_MAX_SIZE])
+            for i in range(0, len(data), ETX_OTA_DATA_MAX_SIZE)]
+
+def page_skips(pages, first_page):
+    """
+    Paginas sin cambios que se saltean antes de cada pagina enviada, y antes
+    del final de la imagen (ultimo valor).
+    """
+    skips = {}
+    prev = first_page - 1
+    for page in pages:
+        skips[page] = page - prev - 1
+        prev = page
+    return skips, prev
+
+def send_skip_to_end(ser, n_pages, skip):
+    """
+    Saltea las ultimas paginas sin cambios: BULK_HEADER con pagina = n_pages.
+    """
+    old_timeout = ser.timeout
+    ser.timeout = WINDOW_TIMEOUT
+    while True:
+        ser.write(make_packet_bulk_header(b"", n_pages, skip))
+        resp = read_response(ser)
+        if resp is not None and resp.status == ETX_OTA_RESP_BULK_OK:
+            break
+        print(f"Reenvio salto final ({error_name(resp) if resp else 'sin respuesta'})")
+    ser.timeout = old_timeout
+
+def send_window(ser, firmware, window, start=0, pages=None, lz=False, delta=None, fill=False, selective=False, fec=False, erasure=0):
+    """
+    Envia el firmware con hasta 'window' paquetes DATA en vuelo, desde el offset 'start'.
+    El micro confirma cada paquete en orden con "ACK <seq>" (acumulativo) y
+    pide reenviar con "NACK <seq>" (hueco o CRC de pagina incorrecto).
+    Con 'pages' (modo diferencial) solo se envian esas paginas.
+    Con 'lz' las paginas que se achican se mandan comprimidas (menos paquetes),
+    y con 'delta' (DeltaBase) como delta de la imagen instalada.
+    Con 'fill' los tramos de un mismo byte van como FILL.
+    Con 'selective' los paquetes sin comprimir llevan el numero de su lugar en la
+    pagina, y los que pide "NACK_MAP <seq> <mapa>" se reenvian sin retroceder.
+    Con 'fec' cada paquete lleva su paridad Reed-Solomon.
+    Con 'erasure' cada pagina sin comprimir sigue con ese numero de paquetes
+    codificados, y el BULK_HEADER va dos veces: las perdidas sueltas no piden reenvio.
+    Los codificados de la pagina del primer paquete sin confirmar salen aunque la
+    ventana este llena (el micro les reserva lugar): son los que destraban su ACK.
+    """
+    if start >= len(firmware):
+        return      # Reanudada con todas las paginas ya programadas
+    n_pages = (len(firmware) + PAGE_SIZE - 1) // PAGE_SIZE
+    first_page = start // PAGE_SIZE
+    diff = pages is not None
+    if not diff:
+        pages = range(first_page, n_pages)
+    skips, last_page = page_skips(pages, first_page)
+
+    # Paquetes a enviar por (numero de secuencia, 0), en orden. Los codificados van
+    # despues del ultimo lugar de su pagina, como (su secuencia, 1 + fila)
+    packets = {}
+    for page in pages:
+        page_seqs = []
+        for i, (slot, packet_type, chunk) in enumerate(page_packets(firmware, page, lz, delta, fill)):
+            seq = page * PACKETS_PER_PAGE + (slot if selective else i)
+            packets[(seq, 0)] = (seq, packet_type, chunk)
+            page_seqs.append(seq)
+        if erasure and all(packets[(seq, 0)][1] != ETX_OTA_PACKET_TYPE_DATA_LZ and
+                           packets[(seq, 0)][1] != ETX_OTA_PACKET_TYPE_DATA_DELTA for seq in page_seqs):
+            slots = (len(firmware[page*PAGE_SIZE:(page+1)*PAGE_SIZE]) + ETX_OTA_DATA_MAX_SIZE - 1) // ETX_OTA_DATA_MAX_SIZE
+            for row, chunk in enumerate(coded_packets(firmware, page, erasure)):
+                packets[(page * PACKETS_PER_PAGE + slots - 1, 1 + row)] = (page * PACKETS_PER_PAGE, ETX_OTA_PACKET_TYPE_CODED, chunk)
+    seqs = sorted(packets)
+    if lz or delta is not None or fill:
+        sent = sum(len(chunk) for _, _, chunk in packets.values())
+        raw = sum(len(firmware[page*PAGE_SIZE:(page+1)*PAGE_SIZE]) for page in pages)
+        print(f"Enviados: {sent} de {raw} bytes ({100 * sent // max(raw, 1)}%)")
+    base = 0        # primer paquete sin confirmar (indice en seqs)
+    next_i = 0      # proximo paquete a enviar (indice en seqs)
+    last_rx = time.time()
+
+    def send_packet(key):
+        seq, packet_type, chunk = packets[key]
+        crc = calculate_crc_word_datapack(chunk)
+        ser.write(make_packet_data(chunk, crc, len(chunk), seq, packet_type, fec))
+
+    old_timeout = ser.timeout
+    ser.timeout = 0.01
+
+    while base < len(seqs):
+        while next_i < len(seqs) and ((next_i - base) < window or
+                                      (seqs[next_i][1] > 0 and seqs[next_i][0] // PACKETS_PER_PAGE == seqs[base][0] // PACKETS_PER_PAGE)):
+            next_seq, sub = seqs[next_i]
+            offset = next_seq * ETX_OTA_DATA_MAX_SIZE
+            if next_seq % PACKETS_PER_PAGE == 0 and sub == 0:
+                page = next_seq // PACKETS_PER_PAGE
+                if diff:
+                    bulk_header = make_packet_bulk_header(firmware[offset:offset+PAGE_SIZE], page, skips[page])
+                else:
+                    bulk_header = make_packet_bulk_header(firmware[offset:offset+PAGE_SIZE])
+                ser.write(bulk_header * (2 if erasure else 1))
+
+            send_packet(seqs[next_i])
+            next_i += 1
+
+        resp = read_response(ser)
+        status = resp.status if resp is not None else None
+        if status == ETX_OTA_RESP_ACK:
+            # Tambien confirma los codificados de la pagina: si no salieron, ya no hacen falta
+            base = max(base, bisect.bisect_right(seqs, (resp.seq, ETX_OTA_ERASURE_ROWS)))
+            next_i = max(next_i, base)
+            last_rx = time.time()
+        elif status == ETX_OTA_RESP_NACK:
+            print(f"NACK ({error_name(resp)}), reenvio desde paquete {resp.seq}")
+            base = bisect.bisect_left(seqs, (resp.seq, 0))
+            next_i = base
+            last_rx = time.time()
+        elif status == ETX_OTA_RESP_NACK_MAP:
+            # Lugares que faltan de la pagina: cada uno lo cubre el paquete que empieza en el o antes (FILL)
+            first, missing = resp.seq, resp.arg0
+            resend = sorted({seqs[bisect.bisect_right(seqs, (first + slot, 0)) - 1]
+                             for slot in range(missing.bit_length()) if (missing >> slot) & 1})
+            print(f"NACK_MAP, reenvio paquetes {[seq for seq, _ in resend]}")
+            for key in resend:
+                send_packet(key)
+            last_rx = time.time()
+        elif time.time() - last_rx > WINDOW_TIMEOUT:
+            print(f"Timeout, reenvio desde paquete {seqs[base][0]}")
+            next_i = base
+            last_rx = time.time()
+
+    ser.timeout = old_timeout
+
+    if diff and last_page < n_pages - 1:
+        send_skip_to_end(ser, n_pages, n_pages - last_page - 1)
+
 
 
 # Abrir puerto serie
-ser = serial.Serial(PORT, BAUDRATE, timeout=1)
+ser = serial.Serial(PORT, BAUDRATE, timeout=1, rtscts=RTSCTS)
 
 
 # Leer firmware
 with open("firmware.bin", "rb") as f:
     firmware = f.read()
 
+# Imagen instalada, base de la actualizacion delta
+old_firmware = None
+if DELTA_BASE and PAGE_DIFF and os.path.exists(DELTA_BASE):
+    with open(DELTA_BASE, "rb") as f:
+        old_firmware = f.read()
+
 # CRC de toda la app
 crc_app = calculate_flash_crc(firmware)
 print(f"CRC App: 0x{crc_app:08X}")
@@ -291,30 +868,99 @@ print(f"Paquetes Totales: {cant_paq}")
 
 start_time = time.time()
 
+# Respuestas viejas de una transferencia cortada: el ACK tiene que ser del START
+ser.reset_input_buffer()
 packet = make_packet_cmd(ETX_OTA_CMD_START)
 ser.write(packet)
 print(f"Mando CMD: START")
 
 #while ack_event 
 while True:
-    line = ser.readline().decode(errors="ignore").strip()
-    line = line.replace("\x00", "").strip()
-    if line == "ACK":
+    resp = read_response(ser)
+    if resp is not None and resp.status == ETX_OTA_RESP_ACK:
         break
-time.sleep(0.5)
+    if resp is not None and resp.status == ETX_OTA_RESP_NACK:
+        print(f"START rechazado ({error_name(resp)}), lo reenvio")
+        ser.write(packet)
+
+# Subir la velocidad del enlace antes del HEADER
+if BAUD_RATES:
+    print(f"Velocidad: {set_baud(ser, sorted(BAUD_RATES, reverse=True))} baudios")
+pause(0.5)
 
 # MANDO HEADER
-packet = make_packet_header(firmware)
+packet = make_packet_header(firmware, WINDOW_SIZE, PAYLOAD_SIZE, PAGE_DIFF, LZSS, old_firmware is not None, FILL, SELECTIVE, FEC,
+                            min(ERASURE, ETX_OTA_ERASURE_ROWS) if SELECTIVE else 0)
 #print(f"HEADER ({len(packet)} bytes): {binascii.hexlify(packet).decode().upper()}")
 ser.write(packet)
 print(f"Mando HEADER")
 
 #while ack_event 
+window = 0
+diff = 0
+lz = 0
+delta = 0
+fill = 0
+selective = 0
+fec = 0
+erasure = 0
 while True:
-    line = ser.readline().decode(errors="ignore").strip()
-    if line == "HEADER_OK":
+    resp = read_response(ser)
+    if resp is not None and resp.status == ETX_OTA_RESP_HEADER_OK:
+        ETX_OTA_DATA_MAX_SIZE = resp.arg0    # tamaño de datos aceptado
+        ETX_OTA_PACKET_MAX_SIZE = ETX_OTA_DATA_MAX_SIZE + ETX_OTA_DATA_OVERHEAD
+        PACKETS_PER_PAGE = PAGE_SIZE // ETX_OTA_DATA_MAX_SIZE
+        if resp.arg1:
+            opts = resp.arg1          # ventana y opciones aceptadas
+            window = opts & 0xFF
+            diff = opts & ETX_OTA_OPT_PAGE_DIFF
+            lz = opts & ETX_OTA_OPT_LZSS
+            delta = opts & ETX_OTA_OPT_DELTA
+            fill = opts & ETX_OTA_OPT_FILL
+            selective = opts & ETX_OTA_OPT_SELECTIVE
+            fec = opts & ETX_OTA_OPT_FEC
+            erasure = (opts >> ETX_OTA_OPT_CODED_SHIFT) & 0xF
         break
-time.sleep(0.1)
+    if resp is not None and resp.status == ETX_OTA_RESP_NACK:
+        print(f"HEADER rechazado ({error_name(resp)}), lo reenvio")
+        ser.write(packet)
+print(f"Ventana: {window}, datos por paquete: {ETX_OTA_DATA_MAX_SIZE}")
+
+# CRC de cada pagina de la App actual (modo diferencial)
+n_pages = (len(firmware) + PAGE_SIZE - 1) // PAGE_SIZE
+device_crcs = {}
+while diff and len(device_crcs) < n_pages:
+    resp = read_response(ser)
+    if resp is not None and resp.status == ETX_OTA_RESP_PAGE_CRC:
+        device_crcs[resp.seq] = resp.arg0
+pause(0.1)
+
+# MANDO RESUME: el micro indica desde donde seguir (0 si no hay nada que retomar)
+start = 0
+if RESUME:
+    ser.write(make_packet_cmd(ETX_OTA_CMD_RESUME))
+    while True:
+        resp = read_response(ser)
+        if resp is not None and resp.status == ETX_OTA_RESP_RESUME:
+            start = resp.arg0
+            break
+        if resp is not None and resp.status == ETX_OTA_RESP_NACK:
+            break
+    print(f"Continuo desde el byte {start}")
+
+# Paginas a enviar: todas, o solo las que cambiaron
+pages = None
+skips = {}
+last_page = start // PAGE_SIZE - 1
+if diff:
+    pages = [page for page in range(start // PAGE_SIZE, n_pages)
+             if device_crcs.get(page) != calculate_flash_crc(firmware[page*PAGE_SIZE:(page+1)*PAGE_SIZE])]
+    skips, last_page = page_skips(pages, start // PAGE_SIZE)
+    print(f"Paginas cambiadas: {len(pages)} de {n_pages}")
+delta_base = None
+if delta:
+    # Solo se copia de las paginas de la imagen instalada que coinciden con su PAGE_CRC
+    delta_base = DeltaBase(old_firmware, n_pages, device_crcs, len(firmware))
 #time.sleep(0.55)
 # Fragmentar y enviar
 # MANDO DATA
@@ -323,71 +969,94 @@ time.sleep(0.1)
 ########### PROBAR DE SUMAR  6144  AL OFFSET PARA EVALUAR EL ULTIMO BULK ###########
 ####################################################################################
 
-offset = 0
-packet_count = 0
+offset = start
+packet_count = start // ETX_OTA_DATA_MAX_SIZE
 bulk_count = 0
+if window > 0:
+    send_window(ser, firmware, window, start, pages, lz, delta_base, fill, selective, fec, erasure)
+    offset = len(firmware)
+
 while offset < len(firmware): # and (packet_count < 128*2):
 
     if(bulk_count == 0):
         
+        page = offset // PAGE_SIZE
+        if pages is not None and page not in pages:
+            # Pagina sin cambios: no se envia
+            offset += PAGE_SIZE
+            packet_count += PACKETS_PER_PAGE
+            continue
+
         bulk_chunk = firmware[offset:offset+PAGE_SIZE]
 
-        bulk_header = make_packet_bulk_header(bulk_chunk) 
+        if pages is not None:
+            bulk_header = make_packet_bulk_header(bulk_chunk, page, skips[page])
+        else:
+            bulk_header = make_packet_bulk_header(bulk_chunk) 
         #print(f"BULK HEADER ({len(bulk_header)} bytes): {binascii.hexlify(bulk_header).decode().upper()}")
         
         ser.write(bulk_header)
 
         #ser.write(bulk_header)
         while True:
-            line = ser.readline()  # lee hasta '\n'
-            if line:
+            resp = read_response(ser)
+            if resp is not None:
                 print("Micro confirmó que BULK fue procesado.")
                 break
-        time.sleep(0.1)
+        pause(0.1)
         #time.sleep(0.55)
     
     chunk = firmware[offset:offset+ETX_OTA_DATA_MAX_SIZE]
+    packet_type = ETX_OTA_PACKET_TYPE_DATA
+    if fill and is_fill(chunk):
+        chunk = make_fill(offset, len(chunk), chunk[0])
+        packet_type = ETX_OTA_PACKET_TYPE_FILL
     length_real = len(chunk)
     crc = calculate_crc_word_datapack(chunk)
 
-    packet = make_packet_data(chunk,crc,length_real)
+    packet = make_packet_data(chunk,crc,length_real,packet_count,packet_type,fec)
     
     #print(f"Paquete {packet_count}: {binascii.hexlify(packet).decode().upper()}")  
     ser.write(packet)
     
     if(bulk_count < PACKETS_PER_PAGE):
         while True:
-            line = ser.readline()  # lee hasta '\n'
-            if line:
+            resp = read_response(ser)
+            if resp is not None and resp.status == ETX_OTA_RESP_NACK:
+                print(f"Paquete {packet_count} rechazado ({error_name(resp)}), lo reenvio")
+                ser.write(packet)
+            elif resp is not None:
                 print("Micro confirmó que DATA fue procesado.")
                 break
 
     packet_count += 1
     bulk_count += 1
     offset += ETX_OTA_DATA_MAX_SIZE
-    time.sleep(0.05)
+    pause(0.05)
     #time.sleep(0)
     if(bulk_count == PACKETS_PER_PAGE):
         print(f"Espero confirmacion de escritura de pagina")
         while True:
-            line = ser.readline().decode(errors="ignore").strip()
-            line = line.replace("\x00", "").strip()
-            #print(f"[{line}] -> {repr(line)} (len={len(line)})")
-            #print(f"{line}")
-            if line == "ACK":
+            resp = read_response(ser)
+            #print(f"{resp}")
+            if resp is not None and resp.status == ETX_OTA_RESP_ACK:
                 #print("Pagina escrita correctamente, continuo")
                 break
-            elif line == "NACK":
-                print("Reenvio ultimo bulk")
+            elif resp is not None and resp.status == ETX_OTA_RESP_NACK:
+                print(f"Reenvio ultimo bulk ({error_name(resp)})")
                 offset -= PAGE_SIZE
                 packet_count -= PACKETS_PER_PAGE
                 break
         bulk_count = 0
         checksum = 0
 
+# Ultimas paginas sin cambios (modo stop-and-wait)
+if window == 0 and diff and last_page < n_pages - 1:
+    send_skip_to_end(ser, n_pages, n_pages - last_page - 1)
+
 # Enviar comando END
 # MANDO END
-time.sleep(0.1)
+pause(0.1)
 end_packet = make_packet_cmd(ETX_OTA_CMD_END)
 #print(f"END ({len(end_packet)} bytes): {binascii.hexlify(end_packet).decode().upper()}")
 ser.write(end_packet)